@@ -0,0 +1,430 @@
+#include "BlockCache.h"
+
+#include <limits.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+BlockCache::BlockCache(std::shared_ptr<MyDisk> bd, size_t capacity)
+    : bd_(bd),
+      capacity_(capacity),
+      slbs_(0),
+      lru_(),
+      spare_(),
+      map_(),
+      stats_(),
+      worker_slbs_(0),
+      stop_(false),
+      pending_(0) {
+  assert(capacity_ > 0);
+  map_.reserve(capacity_);
+}
+
+BlockCache::~BlockCache() {
+  if (worker_.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      stop_ = true;
+    }
+    work_cv_.notify_one();
+    worker_.join();
+  }
+  flush();
+}
+
+const char* BlockCache::read(uint32_t bid, uint32_t slbs) {
+  return lookup(bid, slbs, true).data_;
+}
+
+void BlockCache::write(uint32_t bid, const char* data, uint32_t slbs) {
+  // a full block overwrite never needs the old content
+  forget(bid, 1);
+  auto& e = lookup(bid, slbs, false);
+  memcpy(e.data_, data, 1024 << slbs_);
+  stats_.writes_++;
+  // a borrowed page is already the device copy
+  if (e.owned_) e.dirty_ = true;
+}
+
+bool BlockCache::flush() {
+  auto& dirty = batch_;
+  dirty.clear();
+  for (auto& e : lru_)
+    if (e.dirty_) dirty.push_back(&e);
+  // write back in disk order
+  std::sort(dirty.begin(), dirty.end(),
+            [](const Entry* a, const Entry* b) { return a->bid_ < b->bid_; });
+  // on failure everything stays dirty, to be written again
+  bool ok = transfer(dirty, true);
+  if (ok) {
+    for (auto e : dirty) e->dirty_ = false;
+    stats_.writebacks_ += dirty.size();
+  }
+  return bd_->flush() && ok;
+}
+
+void BlockCache::discard(uint32_t bid, uint32_t count, uint32_t slbs) {
+  setLogBlockSize(slbs);
+  forget(bid, count);
+  if (count < map_.size()) {
+    for (uint32_t i = 0; i < count; i++) {
+      auto it = map_.find(bid + i);
+      if (it != map_.end()) drop(it->second);
+    }
+    return;
+  }
+  for (auto it = lru_.begin(); it != lru_.end();) {
+    auto cur = it++;
+    if (cur->bid_ >= bid && cur->bid_ - bid < count) drop(cur);
+  }
+}
+
+bool BlockCache::readDirect(const Run* runs, size_t n, uint32_t slbs) {
+  setLogBlockSize(slbs);
+  settle(runs, n);
+  size_t block_size = size_t(1024) << slbs_;
+  auto& iov = iov_;
+  auto& reqs = reqs_;
+  size_t blocks = 0;
+  for (size_t r = 0; r < n; r++) blocks += runs[r].count_;
+  // at most one request per block: iov never reallocates under reqs
+  iov.clear();
+  iov.reserve(blocks);
+  reqs.clear();
+  for (size_t r = 0; r < n; r++) {
+    auto& run = runs[r];
+    for (uint32_t i = 0; i < run.count_;) {
+      auto it = map_.find(run.bid_ + i);
+      if (it != map_.end()) {
+        // may be dirty: the cached copy is the current one
+        memcpy(run.buf_ + i * block_size, it->second->data_, block_size);
+        stats_.hits_++;
+        if (it->second->prefetched_) {
+          it->second->prefetched_ = false;
+          stats_.prefetch_hits_++;
+        }
+        i++;
+        continue;
+      }
+      uint32_t j = i + 1;
+      while (j < run.count_ && !map_.count(run.bid_ + j)) j++;
+      iov.push_back({run.buf_ + i * block_size, (j - i) * block_size});
+      reqs.push_back(MyDisk::Request{false, int((run.bid_ + i) << slbs_),
+                                     &iov.back(), 1});
+      stats_.direct_reads_ += j - i;
+      i = j;
+    }
+  }
+  if (reqs.empty()) return true;
+  bool ok = bd_->submit(reqs.data(), reqs.size());
+  return bd_->wait() && ok;
+}
+
+size_t BlockCache::prefetchAsync(const uint32_t* bids, size_t n,
+                                 uint32_t slbs) {
+  setLogBlockSize(slbs);
+  if (!n) return 0;
+  if (bd_->map(bids[0] << slbs_)) {
+    // the device pages are the cache: let the kernel read them in
+    for (size_t i = 0; i < n;) {
+      size_t run = 1;
+      while (i + run < n && bids[i + run] == bids[i] + run) run++;
+      bd_->advise(bids[i] << slbs_, run << slbs_, MyDisk::Advice::WillNeed);
+      i += run;
+    }
+    return 0;
+  }
+  drain();
+  size_t queued = 0;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!worker_.joinable()) worker_ = std::thread(&BlockCache::worker, this);
+    worker_slbs_ = slbs_;
+    // leave most of the cache to blocks that were asked for
+    size_t limit = capacity_ / 4;
+    for (size_t i = 0; i < n && inflight_.size() < limit; i++) {
+      if (map_.count(bids[i]) || !inflight_.insert(bids[i]).second) continue;
+      queued_.push_back(bids[i]);
+      queued++;
+    }
+    pending_ = inflight_.size();
+  }
+  if (queued) work_cv_.notify_one();
+  stats_.prefetched_ += queued;
+  return queued;
+}
+
+bool BlockCache::contains(uint32_t bid) {
+  drain();
+  return map_.count(bid);
+}
+
+bool BlockCache::writeDirect(const Run* runs, size_t n, uint32_t slbs) {
+  setLogBlockSize(slbs);
+  size_t block_size = size_t(1024) << slbs_;
+  auto& iov = iov_;
+  auto& reqs = reqs_;
+  iov.clear();
+  iov.reserve(n);
+  reqs.clear();
+  for (size_t r = 0; r < n; r++) {
+    auto& run = runs[r];
+    // the device copy is about to be the current one
+    discard(run.bid_, run.count_, slbs);
+    iov.push_back({run.buf_, run.count_ * block_size});
+    reqs.push_back(
+        MyDisk::Request{true, int(run.bid_ << slbs_), &iov.back(), 1});
+    stats_.direct_writes_ += run.count_;
+  }
+  if (reqs.empty()) return true;
+  bool ok = bd_->submit(reqs.data(), reqs.size());
+  return bd_->wait() && ok;
+}
+
+void BlockCache::fetch(const uint32_t* bids, size_t n, uint32_t slbs) {
+  setLogBlockSize(slbs);
+  drain();
+  // a batch must not evict its own entries before the data arrives
+  n = std::min(n, capacity_ / 2);
+  auto& missing = batch_;
+  missing.clear();
+  for (size_t i = 0; i < n; i++) {
+    if (map_.count(bids[i])) continue;
+    stats_.misses_++;
+    auto& e = insert(bids[i]);
+    if (e.owned_) missing.push_back(&e);
+  }
+  std::sort(missing.begin(), missing.end(),
+            [](const Entry* a, const Entry* b) { return a->bid_ < b->bid_; });
+  if (transfer(missing, false)) return;
+  // nothing of a failed batch is cached; read() tries each block again
+  stats_.errors_++;
+  for (auto e : missing) drop(map_[e->bid_]);
+}
+
+BlockCache::Entry& BlockCache::lookup(uint32_t bid, uint32_t slbs,
+                                      bool load) {
+  setLogBlockSize(slbs);
+  if (pending_) {
+    // a block being read ahead is worth waiting for
+    Run run{bid, 1, nullptr};
+    if (load)
+      settle(&run, 1);
+    else
+      drain();
+  }
+  auto it = map_.find(bid);
+  if (it != map_.end()) {
+    stats_.hits_++;
+    if (it->second->prefetched_) {
+      it->second->prefetched_ = false;
+      stats_.prefetch_hits_++;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return *it->second;
+  }
+  stats_.misses_++;
+  auto& e = insert(bid);
+  if (load && e.owned_) {
+    struct iovec iov = {e.data_, size_t(1024) << slbs_};
+    if (!bd_->breadv(&iov, 1, bid << slbs_)) {
+      // not cached: the caller gets zeros, and the next read tries again.
+      // The node keeps its buffer in spare_ until it is reused.
+      stats_.errors_++;
+      memset(e.data_, 0, iov.iov_len);
+      map_.erase(bid);
+      spare_.splice(spare_.begin(), lru_, lru_.begin());
+    }
+  }
+  return e;
+}
+
+BlockCache::Entry& BlockCache::insert(uint32_t bid) {
+  if (map_.size() >= capacity_) evict();
+  if (spare_.empty())
+    lru_.emplace_front();
+  else
+    lru_.splice(lru_.begin(), spare_, spare_.begin());
+  auto& e = lru_.front();
+  e.bid_ = bid;
+  e.dirty_ = false;
+  e.prefetched_ = false;
+  e.data_ = bd_->map(bid << slbs_);
+  if (!e.data_) {
+    e.owned_ = BlockPool::get(1024 << slbs_);
+    e.data_ = e.owned_.get();
+  }
+  map_[bid] = lru_.begin();
+  return e;
+}
+
+bool BlockCache::transfer(const std::vector<Entry*>& entries, bool write) {
+  // one request per run of consecutive blocks, the whole batch submitted at
+  // once
+  auto& iov = iov_;
+  auto& reqs = reqs_;
+  iov.resize(entries.size());
+  reqs.clear();
+  for (size_t i = 0; i < entries.size();) {
+    size_t run = 0;
+    do {
+      iov[i + run] = {entries[i + run]->data_, size_t(1024) << slbs_};
+      run++;
+    } while (i + run < entries.size() && run < IOV_MAX &&
+             entries[i + run]->bid_ == entries[i]->bid_ + run);
+    reqs.push_back(MyDisk::Request{write, int(entries[i]->bid_ << slbs_),
+                                   &iov[i], int(run)});
+    i += run;
+  }
+  bool ok = bd_->submit(reqs.data(), reqs.size());
+  return bd_->wait() && ok;
+}
+
+void BlockCache::setLogBlockSize(uint32_t slbs) {
+  if (slbs == slbs_) return;
+  // block numbering changed (e.g. mkfs), nothing cached is valid any more
+  if (pending_) {
+    forget(0, UINT32_MAX);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return inflight_.empty(); });
+  }
+  flush();
+  lru_.clear();
+  map_.clear();
+  slbs_ = slbs;
+}
+
+void BlockCache::evict() {
+  assert(!lru_.empty());
+  auto& victim = lru_.back();
+  // a block that cannot be written back stays, dirty, and the cache runs
+  // over capacity until a write succeeds
+  if (victim.dirty_ && !writeback(victim)) {
+    lru_.splice(lru_.begin(), lru_, std::prev(lru_.end()));
+    return;
+  }
+  drop(std::prev(lru_.end()));
+  stats_.evictions_++;
+}
+
+void BlockCache::drop(std::list<Entry>::iterator it) {
+  if (it->prefetched_) stats_.prefetch_wasted_++;
+  map_.erase(it->bid_);
+  it->owned_.reset();
+  spare_.splice(spare_.begin(), lru_, it);
+}
+
+bool BlockCache::writeback(Entry& e) {
+  struct iovec iov = {e.data_, size_t(1024) << slbs_};
+  if (!bd_->bwritev(&iov, 1, e.bid_ << slbs_)) {
+    stats_.errors_++;
+    return false;
+  }
+  e.dirty_ = false;
+  stats_.writebacks_++;
+  return true;
+}
+
+void BlockCache::worker() {
+  std::vector<uint32_t> bids;
+  std::vector<BlockPool::Handle> bufs;
+  std::vector<struct iovec> iov;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] { return stop_ || !queued_.empty(); });
+    if (stop_) return;
+    bids.swap(queued_);
+    queued_.clear();
+    size_t block_size = size_t(1024) << worker_slbs_;
+    uint32_t shift = worker_slbs_;
+    lock.unlock();
+    // read in disk order, one request per run of consecutive blocks; plain
+    // breadv, as the submission rings belong to the cache's thread
+    std::sort(bids.begin(), bids.end());
+    for (size_t i = 0; i < bids.size();) {
+      size_t run = 1;
+      while (i + run < bids.size() && run < IOV_MAX &&
+             bids[i + run] == bids[i] + run)
+        run++;
+      bufs.clear();
+      iov.clear();
+      for (size_t j = 0; j < run; j++) {
+        bufs.push_back(BlockPool::get(block_size));
+        iov.push_back({bufs.back().get(), block_size});
+      }
+      bool ok = bd_->breadv(iov.data(), run, bids[i] << shift);
+      lock.lock();
+      for (size_t j = 0; j < run; j++) {
+        uint32_t bid = bids[i + j];
+        // a failed read must still drop its stale mark
+        bool was_stale = stale_.erase(bid);
+        if (!ok || was_stale)
+          inflight_.erase(bid);
+        else
+          staged_.emplace_back(bid, std::move(bufs[j]));
+      }
+      pending_ = inflight_.size();
+      lock.unlock();
+      done_cv_.notify_all();
+      i += run;
+    }
+    lock.lock();
+  }
+}
+
+void BlockCache::drain() {
+  if (!pending_) return;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (staged_.empty()) return;
+    arrived_.swap(staged_);
+    for (auto& s : arrived_) inflight_.erase(s.first);
+    pending_ = inflight_.size();
+  }
+  for (auto& s : arrived_) {
+    // loaded meanwhile: the cached copy is at least as new
+    if (map_.count(s.first)) continue;
+    auto& e = insert(s.first);
+    e.owned_ = std::move(s.second);
+    e.data_ = e.owned_.get();
+    e.prefetched_ = true;
+  }
+  arrived_.clear();
+}
+
+void BlockCache::settle(const Run* runs, size_t n) {
+  auto busy = [&] {
+    for (auto bid : inflight_)
+      for (size_t r = 0; r < n; r++)
+        if (bid >= runs[r].bid_ && bid - runs[r].bid_ < runs[r].count_)
+          return true;
+    return false;
+  };
+  while (pending_) {
+    drain();
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!busy()) return;
+    done_cv_.wait(lock, [&] { return !staged_.empty() || !busy(); });
+  }
+}
+
+void BlockCache::forget(uint32_t bid, uint32_t count) {
+  if (!pending_) return;
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto in = [&](uint32_t b) { return b >= bid && b - bid < count; };
+  for (size_t i = 0; i < staged_.size();) {
+    if (in(staged_[i].first)) {
+      inflight_.erase(staged_[i].first);
+      staged_[i] = std::move(staged_.back());
+      staged_.pop_back();
+    } else {
+      i++;
+    }
+  }
+  // still being read: dropped when they arrive
+  for (auto b : inflight_)
+    if (in(b)) stale_.insert(b);
+  pending_ = inflight_.size();
+}
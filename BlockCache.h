@@ -0,0 +1,152 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "BlockPool.h"
+#include "device.h"
+
+// Write-back LRU cache of filesystem blocks, sitting between BlockManager and
+// the device. Blocks are cached at filesystem block granularity
+// (1024 << s_log_block_size_ bytes). When the device can lend its memory
+// (MyDisk::map), entries borrow those pages instead of holding a copy.
+// Buffers come from BlockPool and list nodes are recycled, so a warm cache
+// does not allocate.
+//
+// The cache itself is used from one thread at a time. prefetchAsync() hands
+// device reads to a worker thread; what it reads waits in a staging list and
+// enters the cache at the next call into it, so entries never change under
+// the caller.
+class BlockCache {
+ public:
+  struct Stats {
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t evictions_;
+    // blocks written into the cache; with borrowed pages these are device
+    // writes already, so they are never written back
+    uint64_t writes_;
+    uint64_t writebacks_;
+    // blocks moved by readDirect/writeDirect without being cached
+    uint64_t direct_reads_;
+    uint64_t direct_writes_;
+    // blocks read by prefetchAsync, later used, and dropped unused
+    uint64_t prefetched_;
+    uint64_t prefetch_hits_;
+    uint64_t prefetch_wasted_;
+    // failed device reads and writes; failed blocks are not cached, or stay
+    // dirty
+    uint64_t errors_;
+  };
+
+  // count consecutive blocks from bid_, held in the caller's buffer buf_
+  struct Run {
+    uint32_t bid_;
+    uint32_t count_;
+    char* buf_;
+  };
+
+  BlockCache(std::shared_ptr<MyDisk> bd, size_t capacity = 4096);
+  ~BlockCache();
+
+  // Returns the cached content of block `bid`, loading it on a miss. The
+  // pointer is valid until the next call into the cache.
+  const char* read(uint32_t bid, uint32_t slbs);
+  // Replaces the content of block `bid`; the device is updated lazily.
+  void write(uint32_t bid, const char* data, uint32_t slbs);
+  // Loads the uncached blocks among bids with a single batch of device
+  // requests.
+  void fetch(const uint32_t* bids, size_t n, uint32_t slbs);
+  // Writes every dirty block back to the device as one batch and flushes the
+  // device. On failure the blocks stay dirty.
+  bool flush();
+  // Forgets blocks [bid, bid + count) without writing them back, for blocks
+  // whose content is being thrown away on the device.
+  void discard(uint32_t bid, uint32_t count, uint32_t slbs);
+  // Bulk transfers that bypass the cache and stay coherent with it, one
+  // device request per run (per uncached stretch of a run for reads), all
+  // submitted as one batch. Reads take cached blocks from the cache and do
+  // not cache the rest; writes drop the cached copies of the blocks they
+  // overwrite.
+  bool readDirect(const Run* runs, size_t n, uint32_t slbs);
+  bool writeDirect(const Run* runs, size_t n, uint32_t slbs);
+  // Queues the uncached blocks among bids for the readahead worker and
+  // returns how many were queued. Writes made before the blocks arrive win
+  // over the prefetched copies. On backends that lend their pages this is
+  // only an access hint.
+  size_t prefetchAsync(const uint32_t* bids, size_t n, uint32_t slbs);
+  // whether bid is cached, without loading it
+  bool contains(uint32_t bid);
+
+  size_t size() const { return map_.size(); }
+  size_t capacity() const { return capacity_; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Entry {
+    uint32_t bid_;
+    bool dirty_;
+    // either owned_ or a page borrowed from the device
+    char* data_;
+    BlockPool::Handle owned_;
+    // read ahead and not used yet
+    bool prefetched_;
+  };
+
+  Entry& lookup(uint32_t bid, uint32_t slbs, bool load);
+  // adds an entry for an uncached block without loading it
+  Entry& insert(uint32_t bid);
+  bool transfer(const std::vector<Entry*>& entries, bool write);
+  void setLogBlockSize(uint32_t slbs);
+  void evict();
+  // moves an entry to spare_ without writing it back
+  void drop(std::list<Entry>::iterator it);
+  bool writeback(Entry& e);
+  // readahead worker loop
+  void worker();
+  // moves the finished prefetches into the cache
+  void drain();
+  // waits until no block of the runs is being prefetched, then drains
+  void settle(const Run* runs, size_t n);
+  // cancels the prefetches of [bid, bid + count), about to be overwritten
+  void forget(uint32_t bid, uint32_t count);
+
+  std::shared_ptr<MyDisk> bd_;
+  size_t capacity_;
+  uint32_t slbs_;
+  // front is the most recently used block
+  std::list<Entry> lru_;
+  // evicted nodes kept for reuse
+  std::list<Entry> spare_;
+  std::unordered_map<uint32_t, std::list<Entry>::iterator> map_;
+  Stats stats_;
+  // scratch space reused by flush/fetch
+  std::vector<Entry*> batch_;
+  std::vector<struct iovec> iov_;
+  std::vector<MyDisk::Request> reqs_;
+
+  // readahead state, shared with the worker under mutex_
+  std::thread worker_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::vector<uint32_t> queued_;
+  // queued or being read
+  std::unordered_set<uint32_t> inflight_;
+  // in flight but overwritten since: dropped when they arrive
+  std::unordered_set<uint32_t> stale_;
+  std::vector<std::pair<uint32_t, BlockPool::Handle>> staged_;
+  uint32_t worker_slbs_;
+  bool stop_;
+  // inflight_ plus staged_, readable without the lock
+  std::atomic<size_t> pending_;
+  // drain() scratch
+  std::vector<std::pair<uint32_t, BlockPool::Handle>> arrived_;
+};
@@ -1,5 +1,6 @@
 #include "BlockManager.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
@@ -8,147 +9,493 @@
 #include <iostream>
 #endif
 
+// runs up to this many blocks are zeroed through the cache
+constexpr uint32_t SMALL_ZERO_RUN = 64;
+
+namespace {
+// sets or clears bits [off, off + len), a word at a time
+void setBits(std::vector<uint64_t>& words, uint32_t off, uint32_t len,
+             bool val) {
+  for (uint32_t b = off; b < off + len;) {
+    uint32_t n = std::min(64 - b % 64, off + len - b);
+    uint64_t bits = n == 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1;
+    if (val)
+      words[b / 64] |= bits << b % 64;
+    else
+      words[b / 64] &= ~(bits << b % 64);
+    b += n;
+  }
+}
+
+// the first bit at or after i equal to val, or the end of the bitmap
+uint32_t findBit(const std::vector<uint64_t>& words, uint32_t i, bool val) {
+  return ::findBit(words.data(), words.size(), i, val);
+}
+}  // namespace
+
 SuperBlockManager::SuperBlockManager(std::shared_ptr<MyDisk> bd)
     : bd_(bd), sb_() {
-  assert(BLOCK_SIZE == 1024);
-  auto sb = bd_->bread(1);
-  memcpy(&sb_, sb->s_, sizeof(SuperBlock));
+  // the superblock is at byte 1024 whatever the filesystem block size
+  static_assert(BLOCK_SIZE == 1024, "superblock must be device block 1");
+  DeviceBlock sb;
+  bd_->bread(1, &sb);
+  memcpy(&sb_, sb.s_, sizeof(SuperBlock));
 }
 
 const SuperBlock& SuperBlockManager::readSuperBlock() { return sb_; }
 
 bool SuperBlockManager::writeSuperBlock(const SuperBlock* const sb) {
-  assert(BLOCK_SIZE == 1024);
   memcpy(&sb_, sb, sizeof(SuperBlock));
   DeviceBlock db;
   memcpy(db.s_, sb, sizeof(SuperBlock));
-  bd_->bwrite(&db, 1);
-  return true;
+  return bd_->bwrite(&db, 1);
 }
 
 BlockManager::BlockManager(std::shared_ptr<MyDisk> bd,
-                           std::shared_ptr<SuperBlockManager> sbm, bool readBGD)
-    : bd_(bd), sbm_(sbm), bgd_() {
-  if (readBGD) refresh();
+                           std::shared_ptr<SuperBlockManager> sbm, bool readBGD,
+                           size_t cacheBlocks)
+    : bd_(bd),
+      sbm_(sbm),
+      bgd_(),
+      cache_(bd, cacheBlocks),
+      bitmaps_(),
+      free_blocks_(0),
+      free_inodes_(0),
+      bgd_dirty_(false) {
+  if (readBGD) {
+    refresh();
+    mount();
+  }
+}
+
+BlockManager::~BlockManager() {
+  if (!bgd_.empty()) sync(true);
+}
+
+void BlockManager::mount() {
+  auto sb = sbm_->readSuperBlock();
+  // the counters on disk are only trusted after a clean unmount
+  if (sb.s_state_ == EXT2_VALID_FS) {
+    sb.s_state_ = EXT2_ERROR_FS;
+    sbm_->writeSuperBlock(&sb);
+  } else {
+    recount();
+  }
 }
 
 void BlockManager::refresh() {
+  if (!bgd_.empty()) sync(false);
   auto sb = sbm_->readSuperBlock();
-  auto bgd_block = readBlock(1 + sb.s_first_data_block_);
   auto total_groups = (sb.s_blocks_count_ - sb.s_first_data_block_ +
                        sb.s_blocks_per_group_ - 1) /
                       sb.s_blocks_per_group_;
+  auto per_block =
+      (1024 << sb.s_log_block_size_) / sizeof(Block_Group_Descriptor);
   bgd_.clear();
-  for (int i = 0; i < total_groups; i++) {
-    bgd_.push_back(*reinterpret_cast<Block_Group_Descriptor*>(
-        bgd_block.s_.get() + i * sizeof(Block_Group_Descriptor)));
+  // the table starts right after the superblock and may span several blocks
+  for (uint32_t i = 0; i < total_groups; i += per_block) {
+    auto bgd_block = readBlock(1 + sb.s_first_data_block_ + i / per_block);
+    auto table = reinterpret_cast<Block_Group_Descriptor*>(bgd_block.s_.get());
+    for (uint32_t j = 0; j < per_block && i + j < total_groups; j++)
+      bgd_.push_back(table[j]);
+  }
+  // bitmaps are loaded on first use
+  bitmaps_.clear();
+  bitmaps_.resize(bgd_.size());
+  free_blocks_ = free_inodes_ = 0;
+  for (auto& gd : bgd_) {
+    free_blocks_ += gd.bg_free_blocks_count_;
+    free_inodes_ += gd.bg_free_inodes_count_;
+  }
+  bgd_dirty_ = false;
+}
+
+void BlockManager::recount() {
+  const auto& sb = sbm_->readSuperBlock();
+  free_blocks_ = free_inodes_ = 0;
+  for (uint32_t group = 0; group < bgd_.size(); group++) {
+    uint32_t blocks = 0;
+    for (auto w : loadBitmap(group).words_) blocks += __builtin_popcountll(~w);
+    auto inode_bitmap = readBlock(bgd_[group].bg_inode_bitmap_);
+    uint32_t inodes = 0;
+    for (uint32_t i = 0; i < sb.s_inodes_per_group_; i++)
+      inodes += !(inode_bitmap.s_[i / 8] >> i % 8 & 1);
+    bgd_[group].bg_free_blocks_count_ = blocks;
+    bgd_[group].bg_free_inodes_count_ = inodes;
+    free_blocks_ += blocks;
+    free_inodes_ += inodes;
   }
+  bgd_dirty_ = true;
+}
+
+void BlockManager::countInodes(uint32_t group, int delta) {
+  assert(group < bgd_.size());
+  bgd_[group].bg_free_inodes_count_ += delta;
+  free_inodes_ += delta;
+  bgd_dirty_ = true;
 }
 
 bool BlockManager::tagBlock(uint32_t index, bool val) {
-  auto sb = sbm_->readSuperBlock();
+  const auto& sb = sbm_->readSuperBlock();
   auto maxBlock = sb.s_blocks_count_;
   assert(index >= 0 && index < maxBlock &&
          "Index out of range");  // 确保索引在合法范围内
   auto group = (index - sb.s_first_data_block_) / sb.s_blocks_per_group_;
   auto offset = (index - sb.s_first_data_block_) % sb.s_blocks_per_group_;
   assert(group < bgd_.size() && "Group out of range");
-  auto bitmap_bid = bgd_[group].bg_block_bitmap_;
-  auto bitmap = readBlock(bitmap_bid);
-  int byteIndex = offset / 8;
-  int bitIndex = offset % 8;
+  auto& bitmap = loadBitmap(group);
+  if ((bitmap.words_[offset / 64] >> offset % 64 & 1) == val) return true;
+  int delta = val ? -1 : 1;
+  bgd_[group].bg_free_blocks_count_ += delta;
+  free_blocks_ += delta;
+  bgd_dirty_ = true;
   if (val) {
-    bitmap.s_[byteIndex] |= val << bitIndex;
+    useRun(bitmap, offset, 1);
 #ifndef DEPLOY
     std::cout << "Allocating block " << index << std::endl;
 #endif
   } else {
-    bitmap.s_[byteIndex] &= ~(1 << bitIndex);
+    freeRun(bitmap, offset, 1);
 #ifndef DEPLOY
     std::cout << "Deallocating block " << index << std::endl;
 #endif
   }
-  writeBlock(bitmap, bitmap_bid);
+  bitmap.dirty_ = true;
   return true;
 }
 
+void BlockManager::deferFree(uint32_t bid, uint32_t count) {
+  // files are mostly freed in block order: extend the last run
+  if (!deferred_.empty()) {
+    auto& last = deferred_.back();
+    if (last.first + last.second == bid) {
+      last.second += count;
+      return;
+    }
+  }
+  deferred_.emplace_back(bid, count);
+}
+
+void BlockManager::freeDeferred() {
+  if (deferred_.empty()) return;
+  const auto& sb = sbm_->readSuperBlock();
+  std::sort(deferred_.begin(), deferred_.end());
+  for (auto [first, count] : deferred_) {
+    assert(first >= sb.s_first_data_block_ &&
+           first + count <= sb.s_blocks_count_);
+    while (count) {
+      auto group = (first - sb.s_first_data_block_) / sb.s_blocks_per_group_;
+      auto offset = (first - sb.s_first_data_block_) % sb.s_blocks_per_group_;
+      // the part of the run inside this group
+      uint32_t run = std::min(count, sb.s_blocks_per_group_ - offset);
+      auto& bitmap = loadBitmap(group);
+      uint32_t freed = 0;
+      // the blocks of the run that are in use, a stretch at a time
+      for (uint32_t b = offset; b < offset + run;) {
+        uint32_t used = findBit(bitmap.words_, b, true);
+        if (used >= offset + run) break;
+        uint32_t end =
+            std::min(findBit(bitmap.words_, used, false), offset + run);
+        freeRun(bitmap, used, end - used);
+        freed += end - used;
+        b = end;
+      }
+#ifndef DEPLOY
+      std::cout << "Deallocating blocks " << first << "+" << run << std::endl;
+#endif
+      bitmap.dirty_ = true;
+      bgd_[group].bg_free_blocks_count_ += freed;
+      free_blocks_ += freed;
+      bgd_dirty_ = true;
+      cache_.discard(first, run, sb.s_log_block_size_);
+      first += run;
+      count -= run;
+    }
+  }
+  deferred_.clear();
+}
+
 bool BlockManager::state(uint32_t index) const {
-  auto sb = sbm_->readSuperBlock();
+  const auto& sb = sbm_->readSuperBlock();
   auto maxBlock = sb.s_blocks_count_;
   assert(index >= 0 && index < maxBlock &&
          "Index out of range");  // 确保索引在合法范围内
   auto group = (index - sb.s_first_data_block_) / sb.s_blocks_per_group_;
   auto offset = (index - sb.s_first_data_block_) % sb.s_blocks_per_group_;
   assert(group < bgd_.size() && "Group out of range");
-  auto bitmap_bid = bgd_[group].bg_block_bitmap_;
-  auto bitmap = readBlock(bitmap_bid);
-  int byteIndex = offset / 8;
-  int bitIndex = offset % 8;
-  return bitmap.s_[byteIndex] & (1 << bitIndex);
+  return loadBitmap(group).words_[offset / 64] >> offset % 64 & 1;
 }
 
-uint32_t BlockManager::getIdleBlock() {
-  auto sb = sbm_->readSuperBlock();
-  auto inode_per_tbl = (1024 << sb.s_log_block_size_) / sizeof(inode);
-  auto i_tbl_size =
-      (sb.s_inodes_per_group_ + inode_per_tbl - 1) / inode_per_tbl;
-
+uint32_t BlockManager::getIdleBlock(bool zero) {
+  const auto& sb = sbm_->readSuperBlock();
   for (uint32_t group = 0; group < bgd_.size(); group++) {
-    auto bitmap_bid = bgd_[group].bg_block_bitmap_;
-    auto bitmap = readBlock(bitmap_bid);
-    uint32_t remainBlock = sb.s_blocks_count_ - sb.s_first_data_block_ -
-                           group * sb.s_blocks_per_group_;
-    for (uint32_t i = 0; i < std::min(remainBlock, sb.s_blocks_per_group_);
-         i++) {
-      int byteIndex = i / 8;
-      int bitIndex = i % 8;
-      if (((bitmap.s_[byteIndex] >> bitIndex) & 1) == 0) {
-        bitmap.s_[byteIndex] |= 1 << bitIndex;
-        writeBlock(bitmap, bitmap_bid);
-        // wipe
-        auto abs_bid =
-            sb.s_first_data_block_ + group * sb.s_blocks_per_group_ + i;
-        // TODO move to where should deal with this
-        // if (group == 0 || group == 1 || isPowerOf(group, 3) ||
-        //     isPowerOf(group, 5) || isPowerOf(group, 7))
-        //   // has superblock, group descriptor copy
-        //   abs_bid += 2;
+    if (!bgd_[group].bg_free_blocks_count_) continue;
+    auto& bitmap = loadBitmap(group);
+    if (bitmap.free_.empty()) continue;
+    // the lowest free block
+    uint32_t i = bitmap.free_.begin()->first;
+    useRun(bitmap, i, 1);
+    bitmap.dirty_ = true;
+    bgd_[group].bg_free_blocks_count_--;
+    free_blocks_--;
+    bgd_dirty_ = true;
+    // wipe
+    auto abs_bid = sb.s_first_data_block_ + group * sb.s_blocks_per_group_ + i;
 #ifndef DEPLOY
-        std::cout << "Allocating block " << abs_bid << "(" << i << ")"
-                  << std::endl;
+    std::cout << "Allocating block " << abs_bid << "(" << i << ")"
+              << std::endl;
 #endif
-        FSBlock assigned{
-            std::make_unique<char[]>(1024 << sb.s_log_block_size_)};
-        memset(assigned.s_.get(), 0, 1024 << sb.s_log_block_size_);
-        writeBlock(assigned, abs_bid);
-        return abs_bid;
+    if (zero) zeroBlocks(abs_bid, 1);
+    return abs_bid;
+  }
+  return 0;
+}
+
+uint32_t BlockManager::getIdleRun(uint32_t goal, uint32_t count,
+                                  uint32_t* len) {
+  const auto& sb = sbm_->readSuperBlock();
+  if (!count || !free_blocks_) {
+    *len = 0;
+    return 0;
+  }
+  if (goal < sb.s_first_data_block_ || goal >= sb.s_blocks_count_)
+    goal = sb.s_first_data_block_;
+  uint32_t goal_group =
+      (goal - sb.s_first_data_block_) / sb.s_blocks_per_group_;
+  uint32_t goal_offset =
+      (goal - sb.s_first_data_block_) % sb.s_blocks_per_group_;
+  uint32_t group = 0, first = UINT32_MAX;
+  // the longest run seen, in case none is long enough
+  uint32_t longest_group = 0, longest_first = 0, longest = 0;
+  for (uint32_t n = 0; n < bgd_.size() && first == UINT32_MAX; n++) {
+    group = (goal_group + n) % bgd_.size();
+    if (!bgd_[group].bg_free_blocks_count_) continue;
+    auto& bitmap = loadBitmap(group);
+    if (n == 0) {
+      auto next = bitmap.free_.upper_bound(goal_offset);
+      if (next != bitmap.free_.begin()) {
+        auto at = std::prev(next);
+        // continues whatever ends at the goal, however short
+        if (at->first + at->second > goal_offset) first = goal_offset;
       }
+      if (first == UINT32_MAX && next != bitmap.free_.end() &&
+          next->second >= count)
+        first = next->first;
+    }
+    if (first == UINT32_MAX) {
+      // best fit
+      auto fit = bitmap.by_size_.lower_bound({count, 0});
+      if (fit != bitmap.by_size_.end()) first = fit->second;
+    }
+    if (first == UINT32_MAX && !bitmap.by_size_.empty() &&
+        bitmap.by_size_.rbegin()->first > longest) {
+      longest = bitmap.by_size_.rbegin()->first;
+      longest_first = bitmap.by_size_.rbegin()->second;
+      longest_group = group;
     }
   }
-  assert(0);
+  if (first == UINT32_MAX) {
+    assert(longest > 0);
+    group = longest_group;
+    first = longest_first;
+  }
+  auto& bitmap = loadBitmap(group);
+  auto at = std::prev(bitmap.free_.upper_bound(first));
+  uint32_t run = std::min(count, at->first + at->second - first);
+  useRun(bitmap, first, run);
+  bitmap.dirty_ = true;
+  bgd_[group].bg_free_blocks_count_ -= run;
+  free_blocks_ -= run;
+  bgd_dirty_ = true;
+
+  auto abs_bid =
+      sb.s_first_data_block_ + group * sb.s_blocks_per_group_ + first;
+#ifndef DEPLOY
+  std::cout << "Allocating blocks " << abs_bid << "+" << run << std::endl;
+#endif
+  *len = run;
+  return abs_bid;
+}
+
+void BlockManager::useRun(Bitmap& bitmap, uint32_t off, uint32_t len) {
+  auto at = std::prev(bitmap.free_.upper_bound(off));
+  uint32_t start = at->first, end = at->first + at->second;
+  assert(start <= off && off + len <= end && "blocks not free");
+  bitmap.by_size_.erase({at->second, start});
+  bitmap.free_.erase(at);
+  // what is left on either side
+  if (start < off) {
+    bitmap.free_.emplace(start, off - start);
+    bitmap.by_size_.emplace(off - start, start);
+  }
+  if (off + len < end) {
+    bitmap.free_.emplace(off + len, end - off - len);
+    bitmap.by_size_.emplace(end - off - len, off + len);
+  }
+  setBits(bitmap.words_, off, len, true);
+}
+
+void BlockManager::freeRun(Bitmap& bitmap, uint32_t off, uint32_t len) {
+  uint32_t start = off, end = off + len;
+  // merge with the free runs on either side
+  auto next = bitmap.free_.lower_bound(off);
+  assert((next == bitmap.free_.end() || next->first >= end) &&
+         "blocks already free");
+  if (next != bitmap.free_.end() && next->first == end) {
+    end += next->second;
+    bitmap.by_size_.erase({next->second, next->first});
+    next = bitmap.free_.erase(next);
+  }
+  if (next != bitmap.free_.begin()) {
+    auto prev = std::prev(next);
+    assert(prev->first + prev->second <= off && "blocks already free");
+    if (prev->first + prev->second == off) {
+      start = prev->first;
+      bitmap.by_size_.erase({prev->second, prev->first});
+      bitmap.free_.erase(prev);
+    }
+  }
+  bitmap.free_.emplace(start, end - start);
+  bitmap.by_size_.emplace(end - start, start);
+  setBits(bitmap.words_, off, len, false);
+}
+
+BlockManager::FreeSpaceStats BlockManager::freeSpaceStats() const {
+  FreeSpaceStats stats = {};
+  for (uint32_t group = 0; group < bgd_.size(); group++) {
+    for (auto [len, first] : loadBitmap(group).by_size_) {
+      stats.free_blocks_ += len;
+      stats.runs_++;
+      stats.longest_ = std::max(stats.longest_, len);
+      stats.histogram_[31 - __builtin_clz(len)]++;
+    }
+  }
+  return stats;
+}
+
+BlockManager::Bitmap& BlockManager::loadBitmap(uint32_t group) const {
+  auto& bitmap = bitmaps_[group];
+  if (!bitmap.words_.empty()) return bitmap;
+  const auto& sb = sbm_->readSuperBlock();
+  auto block_size = 1024u << sb.s_log_block_size_;
+  bitmap.words_.resize(block_size / sizeof(uint64_t));
+  memcpy(bitmap.words_.data(), readBlock(bgd_[group].bg_block_bitmap_).s_.get(),
+         block_size);
+  // bits past the end of a short last group never look free
+  uint32_t size = std::min(sb.s_blocks_per_group_,
+                           sb.s_blocks_count_ - sb.s_first_data_block_ -
+                               group * sb.s_blocks_per_group_);
+  for (uint32_t i = size; i < 8 * block_size; i++)
+    bitmap.words_[i / 64] |= uint64_t(1) << i % 64;
+  bitmap.free_.clear();
+  bitmap.by_size_.clear();
+  for (uint32_t i = findBit(bitmap.words_, 0, false); i < 8 * block_size;) {
+    uint32_t end = findBit(bitmap.words_, i, true);
+    bitmap.free_.emplace(i, end - i);
+    bitmap.by_size_.emplace(end - i, i);
+    i = findBit(bitmap.words_, end, false);
+  }
+  bitmap.dirty_ = false;
+  return bitmap;
+}
+
+bool BlockManager::sync(bool clean) {
+  freeDeferred();
+  auto sb = sbm_->readSuperBlock();
+  auto block_size = 1024 << sb.s_log_block_size_;
+  for (uint32_t group = 0; group < bitmaps_.size(); group++) {
+    auto& bitmap = bitmaps_[group];
+    if (!bitmap.dirty_) continue;
+    FSBlock block{BlockPool::get(block_size)};
+    memcpy(block.s_.get(), bitmap.words_.data(), block_size);
+    writeBlock(block, bgd_[group].bg_block_bitmap_);
+    bitmap.dirty_ = false;
+  }
+  if (bgd_dirty_) {
+    auto per_block = block_size / sizeof(Block_Group_Descriptor);
+    for (uint32_t i = 0; i < bgd_.size(); i += per_block) {
+      FSBlock block{BlockPool::get(block_size)};
+      auto n = std::min<size_t>(per_block, bgd_.size() - i);
+      memset(block.s_.get(), 0, block_size);
+      memcpy(block.s_.get(), &bgd_[i], n * sizeof(Block_Group_Descriptor));
+      writeBlock(block, 1 + sb.s_first_data_block_ + i / per_block);
+    }
+    bgd_dirty_ = false;
+  }
+  uint16_t state = clean ? EXT2_VALID_FS : EXT2_ERROR_FS;
+  if (sb.s_free_blocks_count_ != free_blocks_ ||
+      sb.s_free_inodes_count_ != free_inodes_ || sb.s_state_ != state) {
+    // a clean superblock vouches for the bitmaps and descriptors: they must
+    // reach the device first, or the filesystem is not clean. The flush ends
+    // in bd_->flush(), which also covers blocks written in place on map()
+    // backed disks.
+    if (clean && !cache_.flush()) return false;
+    sb.s_free_blocks_count_ = free_blocks_;
+    sb.s_free_inodes_count_ = free_inodes_;
+    sb.s_state_ = state;
+    if (!sbm_->writeSuperBlock(&sb)) return false;
+    if (clean) return bd_->flush();
+  }
+  return true;
 }
 
 FSBlock BlockManager::readBlock(uint32_t bid) const {
   auto slbs = sbm_->readSuperBlock().s_log_block_size_;
   assert(BLOCK_SIZE <= 1024 << slbs);
-  uint32_t start = bid << slbs;
-  uint32_t end = (bid + 1) << slbs;
-  FSBlock block{std::make_unique<char[]>(1024 << slbs)};
-  for (uint32_t i = start; i < end; i++) {
-    auto db = bd_->bread(i);
-    memcpy(block.s_.get() + (i - start) * BLOCK_SIZE, db->s_, BLOCK_SIZE);
-  }
+  FSBlock block{BlockPool::get(1024 << slbs)};
+  memcpy(block.s_.get(), cache_.read(bid, slbs), 1024 << slbs);
   return block;
 }
 bool BlockManager::writeBlock(const FSBlock& block, uint32_t bid) {
   auto slbs = sbm_->readSuperBlock().s_log_block_size_;
   assert(BLOCK_SIZE <= 1024 << slbs);
-  uint32_t start = bid << slbs;
-  uint32_t end = (bid + 1) << slbs;
-  for (uint32_t i = start; i < end; i++) {
-    auto data = reinterpret_cast<DeviceBlock*>(block.s_.get() +
-                                               (i - start) * BLOCK_SIZE);
-    bd_->bwrite(data, i);
-  }
+  cache_.write(bid, block.s_.get(), slbs);
   return true;
-}
\ No newline at end of file
+}
+
+bool BlockManager::zeroBlocks(uint32_t bid, uint32_t count) {
+  auto slbs = sbm_->readSuperBlock().s_log_block_size_;
+  if (count <= SMALL_ZERO_RUN) {
+    // freshly allocated data is usually overwritten while still cached, so
+    // the zeros often never reach the device
+    FSBlock zeros{BlockPool::get(1024 << slbs)};
+    memset(zeros.s_.get(), 0, 1024 << slbs);
+    for (uint32_t i = 0; i < count; i++) writeBlock(zeros, bid + i);
+    return true;
+  }
+  cache_.discard(bid, count, slbs);
+  return bd_->discard(bid << slbs, count << slbs);
+}
+
+bool BlockManager::flush() {
+  bool ok = bgd_.empty() || sync(false);
+  return cache_.flush() && ok;
+}
+
+void BlockManager::advise(uint32_t bid, uint32_t count,
+                          MyDisk::Advice advice) const {
+  auto slbs = sbm_->readSuperBlock().s_log_block_size_;
+  bd_->advise(bid << slbs, count << slbs, advice);
+}
+
+void BlockManager::prefetch(const std::vector<uint32_t>& bids) const {
+  auto slbs = sbm_->readSuperBlock().s_log_block_size_;
+  cache_.fetch(bids.data(), bids.size(), slbs);
+}
+
+size_t BlockManager::prefetchAsync(const std::vector<uint32_t>& bids) const {
+  auto slbs = sbm_->readSuperBlock().s_log_block_size_;
+  return cache_.prefetchAsync(bids.data(), bids.size(), slbs);
+}
+
+bool BlockManager::cached(uint32_t bid) const { return cache_.contains(bid); }
+
+bool BlockManager::readRuns(const std::vector<Run>& runs) const {
+  auto slbs = sbm_->readSuperBlock().s_log_block_size_;
+  return cache_.readDirect(runs.data(), runs.size(), slbs);
+}
+
+bool BlockManager::writeRuns(const std::vector<Run>& runs) {
+  auto slbs = sbm_->readSuperBlock().s_log_block_size_;
+  return cache_.writeDirect(runs.data(), runs.size(), slbs);
+}
@@ -1,6 +1,10 @@
+#include <map>
 #include <memory>
+#include <set>
 #include <vector>
 
+#include "BlockCache.h"
+#include "BlockPool.h"
 #include "device.h"
 #include "ext2.h"
 
@@ -15,8 +19,9 @@ class SuperBlockManager {
   SuperBlock sb_;
 };
 
+// One filesystem block, borrowed from BlockPool.
 struct FSBlock {
-  std::unique_ptr<char[]> s_;
+  BlockPool::Handle s_;
 };
 
 class BGDMangaer {};
@@ -24,20 +29,105 @@ class BGDMangaer {};
 class BlockManager {
  public:
   BlockManager(std::shared_ptr<MyDisk>, std::shared_ptr<SuperBlockManager>,
-               bool readBGD = true);
+               bool readBGD = true, size_t cacheBlocks = 4096);
+  ~BlockManager();
 
-  // didn't check prev value
+  // Marks block index used (val) or free, keeping the counters and the free
+  // run index; a block already in that state is left alone.
   bool tagBlock(uint32_t index, bool val);
-  uint32_t getIdleBlock();
+  // Queues [bid, bid + count) to be freed by freeDeferred(); until then the
+  // blocks stay allocated.
+  void deferFree(uint32_t bid, uint32_t count = 1);
+  // Frees the queued blocks in disk order, clearing the bitmaps a word at a
+  // time per run, and drops their cached copies so that they are never
+  // written back.
+  void freeDeferred();
+  // zero is false when the caller overwrites the whole block anyway; 0 when
+  // the disk is full
+  uint32_t getIdleBlock(bool zero = true);
+  // Allocates up to count contiguous free blocks near goal: the free run
+  // holding goal, else the next run after it if it is long enough, else the
+  // shortest run of at least count blocks, in goal's group first. Only when
+  // no run is long enough is the run returned shorter, the longest there is.
+  // Unlike getIdleBlock the blocks are not zeroed. Returns the first block;
+  // *len is the length of the run, 0 with no block free.
+  uint32_t getIdleRun(uint32_t goal, uint32_t count, uint32_t* len);
   bool state(uint32_t index) const;
 
   FSBlock readBlock(uint32_t bid) const;
   bool writeBlock(const FSBlock& block, uint32_t bid);
+  // zero blocks [bid, bid + count); large ranges are discarded on the device
+  // without going through the cache
+  bool zeroBlocks(uint32_t bid, uint32_t count);
   void refresh();
+  // write back every dirty bitmap, counter and cached block
+  bool flush();
+  // free counters, also kept per group in bgd_
+  uint32_t freeBlocks() const { return free_blocks_; }
+  uint32_t freeInodes() const { return free_inodes_; }
+  // delta inodes of group were freed (negative: allocated)
+  void countInodes(uint32_t group, int delta);
+  // access pattern hint for blocks [bid, bid + count)
+  void advise(uint32_t bid, uint32_t count, MyDisk::Advice advice) const;
+  // load all of bids into the cache with one batch of device requests
+  void prefetch(const std::vector<uint32_t>& bids) const;
+  // start reading bids into the cache in the background, returns how many
+  // were not cached yet
+  size_t prefetchAsync(const std::vector<uint32_t>& bids) const;
+  // whether bid is in the cache
+  bool cached(uint32_t bid) const;
+  // whole-block transfers between file data runs and the device, see
+  // BlockCache::readDirect
+  using Run = BlockCache::Run;
+  bool readRuns(const std::vector<Run>& runs) const;
+  bool writeRuns(const std::vector<Run>& runs);
+  const BlockCache::Stats& cacheStats() const { return cache_.stats(); }
+  struct FreeSpaceStats {
+    uint32_t free_blocks_;
+    // free runs, and the longest one
+    uint32_t runs_;
+    uint32_t longest_;
+    // runs of [2^i, 2^(i+1)) blocks
+    uint32_t histogram_[32];
+  };
+  // fragmentation of the free space; loads every group's bitmap
+  FreeSpaceStats freeSpaceStats() const;
 
   std::vector<Block_Group_Descriptor> bgd_;
 
  private:
   std::shared_ptr<MyDisk> bd_;
   std::shared_ptr<SuperBlockManager> sbm_;
+  mutable BlockCache cache_;
+
+  // A group's block bitmap, resident as 64-bit words once loaded, with its
+  // free runs indexed by position and by length. Changes reach the bitmap
+  // block only in sync().
+  struct Bitmap {
+    std::vector<uint64_t> words_;
+    // free runs of the group: first block (group offset) -> length
+    std::map<uint32_t, uint32_t> free_;
+    // the same runs as (length, first)
+    std::set<std::pair<uint32_t, uint32_t>> by_size_;
+    bool dirty_;
+  };
+  Bitmap& loadBitmap(uint32_t group) const;
+  // mark [off, off + len) of a group used or free, in the words and the
+  // index; the range must lie within one free run, or be all in use
+  static void useRun(Bitmap& bitmap, uint32_t off, uint32_t len);
+  static void freeRun(Bitmap& bitmap, uint32_t off, uint32_t len);
+  // marks the filesystem mounted, recounting the free counters from the
+  // bitmaps unless it was cleanly unmounted
+  void mount();
+  void recount();
+  // writes bitmaps, descriptors and superblock counters; clean marks the
+  // filesystem as cleanly unmounted, flushing first, and false means the
+  // device failed and it was not
+  bool sync(bool clean);
+  mutable std::vector<Bitmap> bitmaps_;
+  // blocks queued by deferFree, as runs (first, count) in queueing order
+  std::vector<std::pair<uint32_t, uint32_t>> deferred_;
+  uint32_t free_blocks_;
+  uint32_t free_inodes_;
+  bool bgd_dirty_;
 };
\ No newline at end of file
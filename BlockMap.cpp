@@ -0,0 +1,123 @@
+#include "BlockMap.h"
+
+#include <algorithm>
+
+namespace {
+// a badly fragmented file starts over rather than growing without bound
+constexpr size_t MAX_EXTENTS = 4096;
+}  // namespace
+
+std::vector<BlockMap::Extent>::iterator BlockMap::lowerBound(uint32_t lbid) {
+  return std::upper_bound(extents_.begin(), extents_.end(), lbid,
+                          [](uint32_t lbid, const Extent& e) {
+                            return lbid < e.lblk_ + e.len_;
+                          });
+}
+
+uint32_t BlockMap::find(uint32_t lbid) const {
+  auto it = std::upper_bound(
+      extents_.begin(), extents_.end(), lbid,
+      [](uint32_t lbid, const Extent& e) { return lbid < e.lblk_ + e.len_; });
+  if (it == extents_.end() || it->lblk_ > lbid) return 0;
+  return it->pblk_ + (lbid - it->lblk_);
+}
+
+void BlockMap::insert(uint32_t lbid, uint32_t pbid) {
+  auto it = lowerBound(lbid);
+  if (it != extents_.end() && it->lblk_ <= lbid) {
+    if (it->pblk_ + (lbid - it->lblk_) == pbid) return;
+    // remapped: drop the stale extent
+    erase(lbid, lbid + 1);
+    it = lowerBound(lbid);
+  }
+  // appending to the previous extent is the common case
+  if (it != extents_.begin()) {
+    auto prev = it - 1;
+    if (prev->lblk_ + prev->len_ == lbid && prev->pblk_ + prev->len_ == pbid) {
+      prev->len_++;
+      if (it != extents_.end() && it->lblk_ == lbid + 1 &&
+          it->pblk_ == pbid + 1) {
+        prev->len_ += it->len_;
+        extents_.erase(it);
+      }
+      return;
+    }
+  }
+  if (it != extents_.end() && it->lblk_ == lbid + 1 && it->pblk_ == pbid + 1) {
+    it->lblk_--;
+    it->pblk_--;
+    it->len_++;
+    return;
+  }
+  if (extents_.size() >= MAX_EXTENTS) {
+    extents_.clear();
+    it = extents_.end();
+  }
+  extents_.insert(it, Extent{lbid, pbid, 1});
+}
+
+void BlockMap::insert(uint32_t lbid, uint32_t pbid, uint32_t len) {
+  if (len == 1) return insert(lbid, pbid);
+  auto it = lowerBound(lbid);
+  // already known, the usual case when a walk repeats
+  if (it != extents_.end() && it->lblk_ <= lbid &&
+      lbid + len <= it->lblk_ + it->len_ &&
+      it->pblk_ + (lbid - it->lblk_) == pbid)
+    return;
+  erase(lbid, lbid + len);
+  if (extents_.size() >= MAX_EXTENTS) extents_.clear();
+  it = extents_.insert(lowerBound(lbid), Extent{lbid, pbid, len});
+  auto next = it + 1;
+  if (next != extents_.end() && next->lblk_ == lbid + len &&
+      next->pblk_ == pbid + len) {
+    it->len_ += next->len_;
+    it = extents_.erase(next) - 1;
+  }
+  if (it != extents_.begin()) {
+    auto prev = it - 1;
+    if (prev->lblk_ + prev->len_ == lbid && prev->pblk_ + prev->len_ == pbid) {
+      prev->len_ += it->len_;
+      extents_.erase(it);
+    }
+  }
+}
+
+void BlockMap::fill(uint32_t first, const uint32_t* pbids, uint32_t n) {
+  erase(first, first + n);
+  std::vector<Extent> runs;
+  for (uint32_t i = 0; i < n; i++) {
+    if (!pbids[i]) continue;
+    if (!runs.empty() && runs.back().lblk_ + runs.back().len_ == first + i &&
+        runs.back().pblk_ + runs.back().len_ == pbids[i])
+      runs.back().len_++;
+    else
+      runs.push_back(Extent{first + i, pbids[i], 1});
+  }
+  if (extents_.size() + runs.size() > MAX_EXTENTS) extents_.clear();
+  extents_.insert(lowerBound(first), runs.begin(), runs.end());
+}
+
+void BlockMap::erase(uint32_t first, uint32_t last) {
+  auto it = lowerBound(first);
+  while (it != extents_.end() && it->lblk_ < last) {
+    uint32_t end = it->lblk_ + it->len_;
+    if (it->lblk_ < first && end > last) {
+      // the range is inside this extent: split it
+      Extent tail{last, it->pblk_ + (last - it->lblk_), end - last};
+      it->len_ = first - it->lblk_;
+      extents_.insert(it + 1, tail);
+      return;
+    }
+    if (it->lblk_ < first) {
+      it->len_ = first - it->lblk_;
+      ++it;
+    } else if (end > last) {
+      it->pblk_ += last - it->lblk_;
+      it->len_ = end - last;
+      it->lblk_ = last;
+      ++it;
+    } else {
+      it = extents_.erase(it);
+    }
+  }
+}
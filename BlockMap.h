@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Cached logical to physical block mappings of one inode, kept as sorted,
+// non-overlapping extents so that a contiguous file costs a handful of
+// entries. Only mapped blocks are recorded: a miss means "walk the indirect
+// blocks", not "hole".
+class BlockMap {
+ public:
+  // physical block of logical block lbid, 0 if not cached
+  uint32_t find(uint32_t lbid) const;
+  // records lbid -> pbid
+  void insert(uint32_t lbid, uint32_t pbid);
+  // records [lbid, lbid + len) -> [pbid, pbid + len)
+  void insert(uint32_t lbid, uint32_t pbid, uint32_t len);
+  // records the n pointers of an indirect block mapping [first, first + n);
+  // zero pointers are holes
+  void fill(uint32_t first, const uint32_t* pbids, uint32_t n);
+  // forgets the mappings of [first, last)
+  void erase(uint32_t first, uint32_t last);
+  void clear() { extents_.clear(); }
+  size_t size() const { return extents_.size(); }
+
+ private:
+  struct Extent {
+    uint32_t lblk_;
+    uint32_t pblk_;
+    uint32_t len_;
+  };
+  // first extent ending after lbid
+  std::vector<Extent>::iterator lowerBound(uint32_t lbid);
+  std::vector<Extent> extents_;
+};
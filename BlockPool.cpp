@@ -0,0 +1,56 @@
+#include "BlockPool.h"
+
+#include <cassert>
+#include <mutex>
+#include <vector>
+
+namespace {
+// one free list per power of two from 1 KiB to 64 KiB
+constexpr int NCLASS = 7;
+
+struct Pool {
+  std::mutex mutex_;
+  std::vector<char*> free_[NCLASS];
+  uint64_t allocations_ = 0;
+};
+
+Pool& pool() {
+  // never destroyed: handles may outlive static destructors
+  static Pool* p = new Pool;
+  return *p;
+}
+
+int sizeClass(size_t size) {
+  int c = 0;
+  while ((size_t(1024) << c) < size) c++;
+  assert(c < NCLASS && (size_t(1024) << c) == size && "unsupported size");
+  return c;
+}
+}  // namespace
+
+BlockPool::Handle BlockPool::get(size_t size) {
+  auto& p = pool();
+  auto& list = p.free_[sizeClass(size)];
+  {
+    std::lock_guard<std::mutex> guard(p.mutex_);
+    if (!list.empty()) {
+      char* buf = list.back();
+      list.pop_back();
+      return Handle(buf, Release{size});
+    }
+    p.allocations_++;
+  }
+  return Handle(new char[size], Release{size});
+}
+
+void BlockPool::Release::operator()(char* buf) const {
+  auto& p = pool();
+  std::lock_guard<std::mutex> guard(p.mutex_);
+  p.free_[sizeClass(size_)].push_back(buf);
+}
+
+uint64_t BlockPool::allocations() {
+  auto& p = pool();
+  std::lock_guard<std::mutex> guard(p.mutex_);
+  return p.allocations_;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Process wide free lists of block buffers (1024 << n bytes). A buffer taken
+// with get() goes back to its free list when the handle is destroyed, so
+// steady state block I/O does not touch the heap. allocations() counts the
+// buffers that had to be allocated because the free list was empty.
+class BlockPool {
+ public:
+  struct Release {
+    size_t size_;
+    void operator()(char* p) const;
+  };
+  using Handle = std::unique_ptr<char[], Release>;
+
+  static Handle get(size_t size);
+  static uint64_t allocations();
+};
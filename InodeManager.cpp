@@ -1,32 +1,240 @@
 #include "InodeManager.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #ifndef DEPLOY
 #include <iostream>
 #endif
+
+#include "util.h"
+
+namespace {
+// whole blocks in the middle of a request at least this large bypass the
+// block cache
+constexpr size_t DIRECT_MIN = 32 * 1024;
+// the first readahead window, doubled on each refill up to ra_max_
+constexpr uint32_t READAHEAD_MIN = 16 * 1024;
+// a full dentry cache starts over
+constexpr size_t DCACHE_MAX = 64 * 1024;
+
+static_assert(sizeof(Extent_Header) == 12 && sizeof(Extent_Leaf) == 12 &&
+                  sizeof(Extent_Index) == 12,
+              "extent tree entries are 12 bytes");
+
+// an extent tree node: the header, then its entries
+Extent_Header* ext_node(void* p) { return static_cast<Extent_Header*>(p); }
+const Extent_Header* ext_node(const void* p) {
+  return static_cast<const Extent_Header*>(p);
+}
+template <class E>
+E* ext_entries(Extent_Header* h) {
+  return reinterpret_cast<E*>(h + 1);
+}
+template <class E>
+const E* ext_entries(const Extent_Header* h) {
+  return reinterpret_cast<const E*>(h + 1);
+}
+// first logical block of entry i
+uint32_t ext_first(const Extent_Header* h, int i) {
+  return h->eh_depth_ ? ext_entries<Extent_Index>(h)[i].ei_block_
+                      : ext_entries<Extent_Leaf>(h)[i].ee_block_;
+}
+// the last entry starting at or before lbid, -1 if there is none
+int ext_search(const Extent_Header* h, uint32_t lbid) {
+  int lo = 0, hi = h->eh_entries_;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ext_first(h, mid) <= lbid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+// ext4's legacy directory hash, with bit 0 cleared for the index
+uint32_t dx_hash(const char* name, size_t len) {
+  uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  auto p = reinterpret_cast<const signed char*>(name);
+  for (size_t i = 0; i < len; i++) {
+    uint32_t hash = hash1 + (hash0 ^ uint32_t(p[i] * 7152373));
+    if (hash & 0x80000000) hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  uint32_t hash = hash0 << 1;
+  // the largest hash means end of directory to ext4
+  return hash == 0xfffffffe ? 0xfffffffc : hash;
+}
+// bytes taken by a dentry with a name of len bytes
+uint16_t dentry_size(size_t len) { return UPPER4(sizeof(dentry) + len); }
+const char* dentry_name(const dentry* d) {
+  return reinterpret_cast<const char*>(d + 1);
+}
+// "." and ".." take 12 bytes each in the root block
+constexpr size_t DX_ROOT_ENTRIES = 24 + sizeof(Dx_Root_Info);
+Dx_Root_Info* dx_root_info(char* root) {
+  return reinterpret_cast<Dx_Root_Info*>(root + 24);
+}
+Dx_Entry* dx_entries(char* node, bool root) {
+  return reinterpret_cast<Dx_Entry*>(node +
+                                     (root ? DX_ROOT_ENTRIES : sizeof(dentry)));
+}
+Dx_Countlimit* dx_countlimit(Dx_Entry* entries) {
+  return reinterpret_cast<Dx_Countlimit*>(entries);
+}
+// the last of the n entries whose hash is at most hash
+uint32_t dx_search(const Dx_Entry* entries, uint32_t n, uint32_t hash) {
+  uint32_t lo = 1, hi = n;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (entries[mid].hash_ <= hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+// an empty index node: a dentry without a name over the whole block
+void dx_init_node(char* node, size_t block_size) {
+  memset(node, 0, block_size);
+  reinterpret_cast<dentry*>(node)->rec_len_ = block_size;
+  dx_countlimit(dx_entries(node, false))->limit_ =
+      (block_size - sizeof(dentry)) / sizeof(Dx_Entry);
+}
+// offset of the live entry named name in a dentry block, and of the entry
+// before it
+bool leaf_find(const char* block, size_t block_size, const std::string& name,
+               size_t* off, size_t* prev) {
+  size_t before = SIZE_MAX;
+  for (size_t o = 0; o < block_size;) {
+    auto d = reinterpret_cast<const dentry*>(block + o);
+    assert(d->rec_len_);
+    if (d->inode_ && d->name_len_ == name.size() &&
+        !memcmp(dentry_name(d), name.data(), name.size())) {
+      *off = o;
+      *prev = before;
+      return true;
+    }
+    before = o;
+    o += d->rec_len_;
+  }
+  return false;
+}
+// puts an entry in the first gap of [0, end) that fits it, false if there
+// is none
+bool leaf_add(char* block, size_t end, uint32_t iid, const std::string& name,
+              uint8_t type) {
+  auto need = dentry_size(name.size());
+  for (size_t o = 0; o < end;) {
+    auto d = reinterpret_cast<dentry*>(block + o);
+    uint16_t used = d->inode_ ? dentry_size(d->name_len_) : 0;
+    if (d->rec_len_ - used >= need) {
+      if (used) {
+        uint16_t rec_len = d->rec_len_ - used;
+        d->rec_len_ = used;
+        d = reinterpret_cast<dentry*>(block + o + used);
+        d->rec_len_ = rec_len;
+      }
+      d->inode_ = iid;
+      d->name_len_ = name.size();
+      d->file_type_ = type;
+      memcpy(d + 1, name.data(), name.size());
+      return true;
+    }
+    o += d->rec_len_;
+  }
+  return false;
+}
+// the largest gap among the entries in [0, end) of a dentry block; adds the
+// bytes taken by entries to *live and stores the offset of the last entry
+uint16_t leaf_space(const char* block, size_t end, uint32_t* live,
+                    size_t* last) {
+  uint16_t gap = 0;
+  for (size_t o = 0; o < end;) {
+    auto d = reinterpret_cast<const dentry*>(block + o);
+    assert(d->rec_len_);
+    uint16_t used = d->inode_ ? dentry_size(d->name_len_) : 0;
+    gap = std::max<uint16_t>(gap, d->rec_len_ - used);
+    *live += used;
+    *last = o;
+    o += d->rec_len_;
+  }
+  return gap;
+}
+// (hash, offset) of the live entries in [from, end) of a dentry block
+using LeafEntries = std::vector<std::pair<uint32_t, uint16_t>>;
+LeafEntries leaf_entries(const char* block, size_t from, size_t end) {
+  LeafEntries ret;
+  for (size_t o = from; o < end;) {
+    auto d = reinterpret_cast<const dentry*>(block + o);
+    assert(d->rec_len_);
+    if (d->inode_) ret.emplace_back(dx_hash(dentry_name(d), d->name_len_), o);
+    o += d->rec_len_;
+  }
+  return ret;
+}
+// writes the entries [first, last) of src packed into a block, the last one
+// stretched to its end
+void leaf_pack(const char* src, LeafEntries::const_iterator first,
+               LeafEntries::const_iterator last, char* dst,
+               size_t block_size) {
+  memset(dst, 0, block_size);
+  size_t o = 0;
+  dentry* d = reinterpret_cast<dentry*>(dst);
+  d->rec_len_ = block_size;
+  for (auto it = first; it != last; ++it) {
+    auto s = reinterpret_cast<const dentry*>(src + it->second);
+    d = reinterpret_cast<dentry*>(dst + o);
+    memcpy(d, s, sizeof(dentry) + s->name_len_);
+    d->rec_len_ = dentry_size(s->name_len_);
+    o += d->rec_len_;
+  }
+  d->rec_len_ += block_size - o;
+}
+}  // namespace
+
 InodeManager::InodeManager(std::shared_ptr<SuperBlockManager> sbm,
-                           std::shared_ptr<BlockManager> bm)
-    : sbm_(sbm), bm_(bm) {}
+                           std::shared_ptr<BlockManager> bm,
+                           size_t cacheInodes)
+    : sbm_(sbm),
+      bm_(bm),
+      icache_(),
+      icache_capacity_(cacheInodes),
+      icache_stats_(),
+      prealloc_(),
+      prealloc_next_(0),
+      alloc_goal_(0),
+      eager_zero_(false),
+      extents_(true),
+      dir_index_(true),
+      ra_max_(128 * 1024),
+      ra_stats_(),
+      dcache_(),
+      dcache_size_(0),
+      dcache_on_(true),
+      dcache_stats_() {}
+
+// the block layer is still alive: it is shared and owned by the caller too
+InodeManager::~InodeManager() { writeback_inodes(false); }
 
 bool InodeManager::getIdleInode(uint32_t* iid) {
   auto sb = sbm_->readSuperBlock();
-  auto inode_per_tbl = (1024 << sb.s_log_block_size_) / sizeof(inode);
-  auto i_tbl_size =
-      (sb.s_inodes_per_group_ + inode_per_tbl - 1) / inode_per_tbl;
+  auto words = (1024 << sb.s_log_block_size_) / sizeof(uint64_t);
   for (uint32_t group = 0; group < bm_->bgd_.size(); group++) {
+    if (!bm_->bgd_[group].bg_free_inodes_count_) continue;
     auto bitmap_bid = bm_->bgd_[group].bg_inode_bitmap_;
     auto bitmap = bm_->readBlock(bitmap_bid);
-    for (uint32_t i = 0; i < sb.s_inodes_per_group_; i++) {
-      int byteIndex = i / 8;
-      int bitIndex = i % 8;
-      if (((bitmap.s_[byteIndex] >> bitIndex) & 1) == 0) {
-        bitmap.s_[byteIndex] |= 1 << bitIndex;
-        bm_->writeBlock(bitmap, bitmap_bid);
-        *iid = group * sb.s_inodes_per_group_ + i + 1;
-        return true;
-      }
-    }
+    uint32_t i = findBit(reinterpret_cast<const uint64_t*>(bitmap.s_.get()),
+                         words, 0, false);
+    if (i >= sb.s_inodes_per_group_) continue;
+    bitmap.s_[i / 8] |= 1 << i % 8;
+    bm_->writeBlock(bitmap, bitmap_bid);
+    bm_->countInodes(group, -1);
+    *iid = group * sb.s_inodes_per_group_ + i + 1;
+    return true;
   }
   return false;
 }
@@ -34,20 +242,22 @@ bool InodeManager::getIdleInode(uint32_t* iid) {
 uint32_t InodeManager::new_inode(const inode& in) {
   uint32_t iid;
   assert(getIdleInode(&iid));
-
-  auto sb = sbm_->readSuperBlock();
-  int block_group = (iid - 1) / sb.s_inodes_per_group_;
-  int local_inode_index = (iid - 1) % sb.s_inodes_per_group_;
-
-  // edit inode table
-  auto inode_per_blk = (1024 << sb.s_log_block_size_) / sizeof(inode);
-  auto inode_tbl_bid = bm_->bgd_[block_group].bg_inode_table_ +
-                       local_inode_index / inode_per_blk;
-  auto local_inode_index_in_block = local_inode_index % inode_per_blk;
-  auto inode_tbl_block = bm_->readBlock(inode_tbl_bid);
-  auto inode_tbl = reinterpret_cast<inode_table*>(inode_tbl_block.s_.get());
-  inode_tbl->inodes_[local_inode_index_in_block] = in;
-  bm_->writeBlock(inode_tbl_block, inode_tbl_bid);
+  // no need to read the old table entry, it is overwritten at writeback
+  auto& e = icache_[iid];
+  e.in_ = in;
+  if (extents_ && !in.i_blocks_ && !(in.i_flags_ & EXT4_EXTENTS_FL)) {
+    // an empty tree: a root leaf without entries
+    e.in_.i_flags_ |= EXT4_EXTENTS_FL;
+    memset(e.in_.i_block_, 0, sizeof(e.in_.i_block_));
+    auto root = ext_node(e.in_.i_block_);
+    root->eh_magic_ = EXT4_EXT_MAGIC;
+    root->eh_max_ =
+        (sizeof(e.in_.i_block_) - sizeof(Extent_Header)) / sizeof(Extent_Leaf);
+  }
+  e.dirty_ = true;
+  e.map_.clear();
+  e.space_ = false;
+  e.stuck_live_ = UINT32_MAX;
   return iid;
 }
 
@@ -62,259 +272,794 @@ bool InodeManager::del_inode(uint32_t iid) {
   assert(inode_map_block.s_[byteIndex] & (1 << bitIndex));
   inode_map_block.s_[byteIndex] &= ~(1 << bitIndex);
   bm_->writeBlock(inode_map_block, bitmap_bid);
+  bm_->countInodes(block_group, 1);
+  // the inode ID may come back as a new directory
+  forget_dentries(iid);
+  auto it = icache_.find(iid);
+  if (it != icache_.end()) {
+    if (it->second.refs_) {
+      it->second.map_.clear();
+      it->second.space_ = false;
+      it->second.stuck_live_ = UINT32_MAX;
+    } else
+      icache_.erase(it);
+  }
   return true;
 }
 
-inode InodeManager::read_inode(uint32_t iid) const {
-  auto sb = sbm_->readSuperBlock();
+std::pair<uint32_t, uint32_t> InodeManager::inode_location(
+    uint32_t iid) const {
+  auto& sb = sbm_->readSuperBlock();
   int block_group = (iid - 1) / sb.s_inodes_per_group_;
   int local_inode_index = (iid - 1) % sb.s_inodes_per_group_;
-
   auto inode_per_blk = (1024 << sb.s_log_block_size_) / sizeof(inode);
-  auto i_tbl_bid = bm_->bgd_[block_group].bg_inode_table_ +
-                   local_inode_index / inode_per_blk;
-  auto local_inode_index_in_block = local_inode_index % inode_per_blk;
+  return {bm_->bgd_[block_group].bg_inode_table_ +
+              local_inode_index / inode_per_blk,
+          local_inode_index % inode_per_blk};
+}
 
+InodeManager::CachedInode& InodeManager::lookup_inode(uint32_t iid) const {
+  auto it = icache_.find(iid);
+  if (it != icache_.end()) {
+    icache_stats_.hits_++;
+    return it->second;
+  }
+  icache_stats_.misses_++;
+  if (icache_.size() >= icache_capacity_) writeback_inodes(true);
+  auto [i_tbl_bid, index] = inode_location(iid);
   auto i_tbl = bm_->readBlock(i_tbl_bid);
-  auto itbl = reinterpret_cast<inode_table*>(i_tbl.s_.get());
-  return itbl->inodes_[local_inode_index_in_block];
+  auto& e = icache_[iid];
+  e.in_ = reinterpret_cast<inode*>(i_tbl.s_.get())[index];
+  e.refs_ = 0;
+  e.dirty_ = false;
+  e.space_ = false;
+  e.stuck_live_ = UINT32_MAX;
+  return e;
 }
 
-bool InodeManager::write_inode(const inode& in, uint32_t iid) {
-  auto sb = sbm_->readSuperBlock();
-  int block_group = (iid - 1) / sb.s_inodes_per_group_;
-  int local_inode_index = (iid - 1) % sb.s_inodes_per_group_;
+void InodeManager::writeback_inodes(bool evict) const {
+  std::vector<std::pair<uint32_t, uint32_t>> dirty;
+  for (auto& [iid, e] : icache_)
+    if (e.dirty_) dirty.emplace_back(inode_location(iid).first, iid);
+  // all the inodes sharing a table block go out in one read-modify-write
+  std::sort(dirty.begin(), dirty.end());
+  for (size_t i = 0; i < dirty.size();) {
+    auto i_tbl_bid = dirty[i].first;
+    auto i_tbl = bm_->readBlock(i_tbl_bid);
+    auto itbl = reinterpret_cast<inode*>(i_tbl.s_.get());
+    for (; i < dirty.size() && dirty[i].first == i_tbl_bid; i++) {
+      auto& e = icache_[dirty[i].second];
+      itbl[inode_location(dirty[i].second).second] = e.in_;
+      e.dirty_ = false;
+    }
+    bm_->writeBlock(i_tbl, i_tbl_bid);
+    icache_stats_.writebacks_++;
+  }
+  if (!evict) return;
+  for (auto it = icache_.begin(); it != icache_.end();) {
+    if (it->second.refs_)
+      ++it;
+    else
+      it = icache_.erase(it);
+  }
+}
 
-  auto inode_per_blk = (1024 << sb.s_log_block_size_) / sizeof(inode);
-  auto i_tbl_bid = bm_->bgd_[block_group].bg_inode_table_ +
-                   local_inode_index / inode_per_blk;
-  auto local_inode_index_in_block = local_inode_index % inode_per_blk;
+inode InodeManager::read_inode(uint32_t iid) const {
+  return lookup_inode(iid).in_;
+}
 
-  auto i_tbl = bm_->readBlock(i_tbl_bid);
-  auto itbl = reinterpret_cast<inode_table*>(i_tbl.s_.get());
-  itbl->inodes_[local_inode_index_in_block] = in;
-  bm_->writeBlock(i_tbl, i_tbl_bid);
+bool InodeManager::write_inode(const inode& in, uint32_t iid) {
+  auto& e = lookup_inode(iid);
+  // pointers changed outside bmap_alloc/resize: the mappings may be stale
+  if (memcmp(e.in_.i_block_, in.i_block_, sizeof(in.i_block_))) {
+    e.map_.clear();
+    e.space_ = false;
+  }
+  e.in_ = in;
+  e.dirty_ = true;
   return true;
 }
+
+void InodeManager::acquire_inode(uint32_t iid) { lookup_inode(iid).refs_++; }
+
+void InodeManager::release_inode(uint32_t iid) {
+  auto it = icache_.find(iid);
+  // already gone if the inode was deleted while referenced
+  if (it == icache_.end()) return;
+  assert(it->second.refs_);
+  it->second.refs_--;
+}
+
+bool InodeManager::flush() {
+  writeback_inodes(false);
+  return bm_->flush();
+}
+
 size_t InodeManager::write_inode_data(uint32_t iid, const void* src,
-                                      size_t offset, size_t size) const {
-  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+                                      size_t offset, size_t size) {
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
   auto in = read_inode(iid);
+  auto i_blocks = in.i_blocks_;
+  size_t last = (offset + size - 1) / block_size;
+  size_t first_full = (offset + block_size - 1) / block_size;
+  size_t end_full = (offset + size) / block_size;
+  bool direct = end_full > first_full &&
+                (end_full - first_full) * block_size >= DIRECT_MIN;
+  if (!direct && size > block_size) prepare_range(in, iid, offset, size);
   size_t written = 0;
   while (written < size) {
     size_t cur = offset + written;
+    if (direct && cur == first_full * block_size) {
+      size_t n = write_direct(in, iid, (const char*)src + written, first_full,
+                              end_full, last);
+      written += n * block_size;
+      if (first_full + n < end_full) break;
+      continue;
+    }
     size_t next_boundary = (cur + block_size) / block_size * block_size;
     assert(next_boundary >= offset);
-    written +=
-        write_inode_data_helper(in, (char*)src + written, cur,
-                                std::min(size - written, next_boundary - cur));
+    size_t n = write_inode_data_helper(
+        in, iid, (const char*)src + written, cur,
+        std::min(size - written, next_boundary - cur), last);
+    if (!n) break;
+    written += n;
   }
-  assert(written == size);
+  // a write cut short by a full disk gives back what it reserved too
+  releaseBlocks();
+  // blocks were allocated: the pointers and i_blocks_ changed
+  if (in.i_blocks_ != i_blocks) write_inode(in, iid);
   return written;
 }
 
 size_t InodeManager::read_inode_data(uint32_t iid, void* dst, size_t offset,
-                                     size_t size) const {
-  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+                                     size_t size, Readahead* ra) const {
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
   auto in = read_inode(iid);
+  if (ra) readahead(in, iid, ra, offset, size);
+  size_t first_full = (offset + block_size - 1) / block_size;
+  size_t end_full = (offset + size) / block_size;
+  bool direct = end_full > first_full &&
+                (end_full - first_full) * block_size >= DIRECT_MIN;
+  if (!direct && size > block_size) prepare_range(in, iid, offset, size);
   size_t readed = 0;
   while (readed < size) {
     size_t cur = offset + readed;
+    if (direct && cur == first_full * block_size) {
+      read_direct(in, iid, (char*)dst + readed, first_full, end_full);
+      readed += (end_full - first_full) * block_size;
+      continue;
+    }
     size_t next_boundary = (cur + block_size) / block_size * block_size;
     assert(next_boundary >= offset);
     readed +=
-        read_inode_data_helper(in, (char*)dst + readed, cur,
+        read_inode_data_helper(in, iid, (char*)dst + readed, cur,
                                std::min(size - readed, next_boundary - cur));
   }
   assert(readed == size);
   return readed;
 }
 
-size_t InodeManager::read_inode_data_helper(const inode& in, void* dst,
-                                            size_t offset, size_t size) const {
+uint32_t InodeManager::bmap(const inode& in, uint32_t iid, size_t lbid,
+                           uint32_t* missing) const {
+  if (in.i_flags_ & EXT4_EXTENTS_FL) return ext_bmap(in, iid, lbid, missing);
+  auto n_entries =
+      (1024 << sbm_->readSuperBlock().s_log_block_size_) / sizeof(uint32_t);
+  if (lbid < NDIRECT_BLOCK) return in.i_block_[lbid];
+  auto map = block_map(iid);
+  if (map) {
+    auto bid = map->find(lbid);
+    if (bid) {
+      icache_stats_.map_hits_++;
+      return bid;
+    }
+    icache_stats_.map_walks_++;
+  }
+  size_t target = lbid;
+  // one single, one double and one triple indirect block
+  lbid -= NDIRECT_BLOCK;
+  int level = 1;
+  size_t span = n_entries;
+  while (lbid >= span) {
+    lbid -= span;
+    span *= n_entries;
+    level++;
+  }
+  assert(level <= 3);
+  uint32_t bid = in.i_block_[NDIRECT_BLOCK + level - 1];
+  for (; level > 0 && bid; level--) {
+    span /= n_entries;
+    if (missing && !bm_->cached(bid)) {
+      *missing = bid;
+      return 0;
+    }
+    auto block = bm_->readBlock(bid);
+    auto entries = (uint32_t*)block.s_.get();
+    bid = entries[lbid / span];
+    // the last indirect block maps its neighbours too: remember them all,
+    // unless this is a hole about to be filled block by block
+    if (level == 1 && map && bid) map->fill(target - lbid, entries, n_entries);
+    lbid %= span;
+  }
+  return bid;
+}
+
+uint32_t InodeManager::ext_bmap(const inode& in, uint32_t iid, size_t lbid,
+                               uint32_t* missing) const {
+  auto map = block_map(iid);
+  if (map) {
+    auto bid = map->find(lbid);
+    if (bid) {
+      icache_stats_.map_hits_++;
+      return bid;
+    }
+    icache_stats_.map_walks_++;
+  }
+  auto h = ext_node(in.i_block_);
+  FSBlock block;
+  while (h->eh_depth_) {
+    int i = ext_search(h, lbid);
+    if (i < 0) return 0;
+    auto child = ext_entries<Extent_Index>(h)[i].ei_leaf_lo_;
+    if (missing && !bm_->cached(child)) {
+      *missing = child;
+      return 0;
+    }
+    block = bm_->readBlock(child);
+    h = ext_node(block.s_.get());
+  }
+  int i = ext_search(h, lbid);
+  if (i < 0) return 0;
+  auto& e = ext_entries<Extent_Leaf>(h)[i];
+  if (lbid >= e.ee_block_ + e.ee_len_) return 0;
+  // the whole extent is one entry of the map
+  if (map) map->insert(e.ee_block_, e.ee_start_lo_, e.ee_len_);
+  return e.ee_start_lo_ + (lbid - e.ee_block_);
+}
+
+uint32_t InodeManager::ext_new_node(inode& in, FSBlock* block) {
   auto slbs = sbm_->readSuperBlock().s_log_block_size_;
   auto block_size = 1024 << slbs;
-  auto n_entries = block_size / sizeof(uint32_t);
-  assert(size + (offset % block_size) <= block_size);
-  int used_block = in.i_blocks_ / (2 << slbs);
-  size_t bid = offset / block_size;
-  size_t local_offset = offset % block_size;
-  if (bid < NDIRECT_BLOCK) {
-    assert(in.i_block_[bid]);
-    assert(bm_->state(in.i_block_[bid]));
-    auto block = bm_->readBlock(in.i_block_[bid]);
-    size_t read_size = std::min(size, block_size - local_offset);
-    memcpy(dst, block.s_.get() + local_offset, read_size);
-    return read_size;
-  } else if (bid < NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries) {
-    assert(in.i_block_[NDIRECT_BLOCK]);
-    assert(bm_->state(in.i_block_[NDIRECT_BLOCK]));
-    auto b1 = bm_->readBlock(in.i_block_[NDIRECT_BLOCK]);
-    auto local_bid = bid - NDIRECT_BLOCK;
-    auto bid1 = local_bid;
-    assert(*((uint32_t*)b1.s_.get() + bid1));
-    assert(bm_->state(*((uint32_t*)b1.s_.get() + bid1)));
-    auto block = bm_->readBlock(*((uint32_t*)b1.s_.get() + bid1));
-    size_t read_size = std::min(size, block_size - local_offset);
-    memcpy(dst, block.s_.get() + local_offset, read_size);
-    return read_size;
-  } else if (bid < NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                       N2INDIRECT_BLOCK * n_entries * n_entries) {
-    assert(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK]);
-    assert(bm_->state(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK]));
-    auto b1 = bm_->readBlock(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK]);
-    auto local_bid = bid - NDIRECT_BLOCK - N1INDIRECT_BLOCK * n_entries;
-    auto bid1 = local_bid / n_entries;
-    auto bid2 = local_bid % n_entries;
-    assert(*((uint32_t*)b1.s_.get() + bid1));
-    assert(bm_->state(*((uint32_t*)b1.s_.get() + bid1)));
-    auto b2 = bm_->readBlock(*((uint32_t*)b1.s_.get() + bid1));
-    assert(*((uint32_t*)b2.s_.get() + bid2));
-    assert(bm_->state(*((uint32_t*)b2.s_.get() + bid2)));
-    auto block = bm_->readBlock(*((uint32_t*)b2.s_.get() + bid2));
-
-    size_t read_size = std::min(size, block_size - local_offset);
-    memcpy(dst, block.s_.get() + local_offset, read_size);
-    return read_size;
-  } else if (bid < NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                       N2INDIRECT_BLOCK * n_entries * n_entries +
-                       N3INDIRECT_BLOCK * n_entries * n_entries * n_entries) {
-    assert(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK]);
-    assert(bm_->state(
-        in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK]));
-    auto b1 = bm_->readBlock(
-        in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK]);
-    auto local_bid = bid - NDIRECT_BLOCK - N1INDIRECT_BLOCK * n_entries -
-                     N2INDIRECT_BLOCK * n_entries * n_entries;
-    auto bid1 = local_bid / n_entries / n_entries;
-    auto bid2 = local_bid / n_entries % n_entries;
-    auto bid3 = local_bid % n_entries;
-    assert(*((uint32_t*)b1.s_.get() + bid1));
-    assert(bm_->state(*((uint32_t*)b1.s_.get() + bid1)));
-    auto b2 = bm_->readBlock(*((uint32_t*)b1.s_.get() + bid1));
-    assert(*((uint32_t*)b2.s_.get() + bid2));
-    assert(bm_->state(*((uint32_t*)b2.s_.get() + bid2)));
-    auto b3 = bm_->readBlock(*((uint32_t*)b2.s_.get() + bid2));
-    assert(*((uint32_t*)b3.s_.get() + bid3));
-    assert(bm_->state(*((uint32_t*)b3.s_.get() + bid3)));
-    auto block = bm_->readBlock(*((uint32_t*)b3.s_.get() + bid3));
-    size_t read_size = std::min(size, block_size - local_offset);
-    memcpy(dst, block.s_.get() + local_offset, read_size);
-    return read_size;
+  // written whole by the caller
+  auto bid = allocBlock(false);
+  in.i_blocks_ += 2 << slbs;
+  block->s_ = BlockPool::get(block_size);
+  memset(block->s_.get(), 0, block_size);
+  auto h = ext_node(block->s_.get());
+  h->eh_magic_ = EXT4_EXT_MAGIC;
+  h->eh_max_ = (block_size - sizeof(Extent_Header)) / sizeof(Extent_Leaf);
+  return bid;
+}
+
+void InodeManager::ext_insert(inode& in, uint32_t lbid, uint32_t pbid) {
+  auto root = ext_node(in.i_block_);
+  {
+    // the extent before lbid usually ends right before pbid too: growing it
+    // is all an append needs
+    auto h = root;
+    FSBlock block;
+    uint32_t bid = 0;
+    int i = ext_search(h, lbid);
+    while (h->eh_depth_ && i >= 0) {
+      bid = ext_entries<Extent_Index>(h)[i].ei_leaf_lo_;
+      block = bm_->readBlock(bid);
+      h = ext_node(block.s_.get());
+      i = ext_search(h, lbid);
+    }
+    if (!h->eh_depth_ && i >= 0) {
+      auto& e = ext_entries<Extent_Leaf>(h)[i];
+      if (e.ee_block_ + e.ee_len_ == lbid &&
+          e.ee_start_lo_ + e.ee_len_ == pbid && e.ee_len_ < EXT4_EXT_MAX_LEN) {
+        e.ee_len_++;
+        if (bid) bm_->writeBlock(block, bid);
+        return;
+      }
+    }
+  }
+
+  if (root->eh_entries_ == root->eh_max_) {
+    // full root: push its entries down into a new node
+    FSBlock child;
+    auto child_bid = ext_new_node(in, &child);
+    auto ch = ext_node(child.s_.get());
+    ch->eh_depth_ = root->eh_depth_;
+    ch->eh_entries_ = root->eh_entries_;
+    memcpy(ch + 1, root + 1, root->eh_entries_ * sizeof(Extent_Leaf));
+    bm_->writeBlock(child, child_bid);
+    root->eh_depth_++;
+    root->eh_entries_ = 1;
+    ext_entries<Extent_Index>(root)[0] =
+        Extent_Index{ext_first(ch, 0), child_bid, 0, 0};
+  }
+  // Walk down, splitting full nodes on the way so that there is always room
+  // for a new entry in the parent.
+  auto h = root;
+  FSBlock block;
+  uint32_t bid = 0;  // 0 while h is the root in the inode
+  while (h->eh_depth_) {
+    auto idx = ext_entries<Extent_Index>(h);
+    int i = std::max(ext_search(h, lbid), 0);
+    bool dirty = false;
+    if (lbid < idx[i].ei_block_) {
+      // lbid comes before everything mapped
+      idx[i].ei_block_ = lbid;
+      dirty = true;
+    }
+    uint32_t child_bid = idx[i].ei_leaf_lo_;
+    auto child = bm_->readBlock(child_bid);
+    auto ch = ext_node(child.s_.get());
+    if (ch->eh_entries_ == ch->eh_max_) {
+      FSBlock right;
+      auto right_bid = ext_new_node(in, &right);
+      auto rh = ext_node(right.s_.get());
+      rh->eh_depth_ = ch->eh_depth_;
+      // an append leaves the full leaf alone and starts an empty one
+      bool append =
+          !ch->eh_depth_ && lbid > ext_first(ch, ch->eh_entries_ - 1);
+      uint16_t keep = append ? ch->eh_entries_ : ch->eh_entries_ / 2;
+      rh->eh_entries_ = ch->eh_entries_ - keep;
+      memcpy(rh + 1, ext_entries<Extent_Leaf>(ch) + keep,
+             rh->eh_entries_ * sizeof(Extent_Leaf));
+      ch->eh_entries_ = keep;
+      uint32_t right_first = append ? lbid : ext_first(rh, 0);
+      memmove(idx + i + 2, idx + i + 1,
+              (h->eh_entries_ - i - 1) * sizeof(Extent_Index));
+      idx[i + 1] = Extent_Index{right_first, right_bid, 0, 0};
+      h->eh_entries_++;
+      dirty = true;
+      bm_->writeBlock(child, child_bid);
+      bm_->writeBlock(right, right_bid);
+      if (lbid >= right_first) {
+        child = std::move(right);
+        child_bid = right_bid;
+      }
+    }
+    if (dirty && bid) bm_->writeBlock(block, bid);
+    block = std::move(child);
+    bid = child_bid;
+    h = ext_node(block.s_.get());
+  }
+  auto ext = ext_entries<Extent_Leaf>(h);
+  int i = ext_search(h, lbid) + 1;
+  memmove(ext + i + 1, ext + i, (h->eh_entries_ - i) * sizeof(Extent_Leaf));
+  ext[i] = Extent_Leaf{lbid, 1, 0, pbid};
+  h->eh_entries_++;
+  if (bid) bm_->writeBlock(block, bid);
+}
+
+bool InodeManager::ext_truncate(Extent_Header* h, uint32_t first,
+                                uint32_t* freed) {
+  int n = h->eh_entries_;
+  if (!h->eh_depth_) {
+    auto ext = ext_entries<Extent_Leaf>(h);
+    for (; n > 0; n--) {
+      auto& e = ext[n - 1];
+      if (e.ee_block_ + e.ee_len_ <= first) break;
+      uint32_t keep = e.ee_block_ < first ? first - e.ee_block_ : 0;
+      bm_->deferFree(e.ee_start_lo_ + keep, e.ee_len_ - keep);
+      *freed += e.ee_len_ - keep;
+      if (keep) {
+        e.ee_len_ = keep;
+        break;
+      }
+    }
   } else {
-    assert(0);
+    auto idx = ext_entries<Extent_Index>(h);
+    for (; n > 0; n--) {
+      auto& ix = idx[n - 1];
+      auto child = bm_->readBlock(ix.ei_leaf_lo_);
+      if (!ext_truncate(ext_node(child.s_.get()), first, freed)) {
+        bm_->writeBlock(child, ix.ei_leaf_lo_);
+        break;
+      }
+      bm_->deferFree(ix.ei_leaf_lo_);
+      (*freed)++;
+      // the nodes before this one only map blocks before it
+      if (ix.ei_block_ < first) {
+        n--;
+        break;
+      }
+    }
+  }
+  h->eh_entries_ = n;
+  return !n;
+}
+
+BlockMap* InodeManager::block_map(uint32_t iid) const {
+  if (!iid) return nullptr;
+  auto it = icache_.find(iid);
+  return it == icache_.end() ? nullptr : &it->second.map_;
+}
+
+void InodeManager::keep_pointers(const inode& in, uint32_t iid) {
+  if (!iid) return;
+  auto it = icache_.find(iid);
+  if (it == icache_.end()) return;
+  memcpy(it->second.in_.i_block_, in.i_block_, sizeof(in.i_block_));
+}
+
+void InodeManager::readahead(const inode& in, uint32_t iid, Readahead* ra,
+                             size_t offset, size_t size) const {
+  if (!ra_max_) return;
+  if (offset != ra->next_) {
+    // random access: start over
+    ra_stats_.random_++;
+    ra->next_ = offset + size;
+    ra->ahead_ = 0;
+    ra->window_ = 0;
+    return;
+  }
+  ra_stats_.sequential_++;
+  ra->next_ = offset + size;
+  // refill once the reader is halfway into the window
+  if (ra->ahead_ >= ra->next_ + ra->window_ / 2) return;
+  ra->window_ = ra->window_ ? std::min(ra->window_ * 2, ra_max_)
+                            : std::min(READAHEAD_MIN, ra_max_);
+  ra_stats_.peak_window_ = std::max(ra_stats_.peak_window_, ra->window_);
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  uint64_t from = std::max(ra->ahead_, ra->next_);
+  uint64_t to = std::min<uint64_t>(ra->next_ + ra->window_, in.i_size_);
+  auto& bids = range_bids_;
+  bids.clear();
+  uint64_t lbid = from / block_size;
+  for (; lbid * block_size < to; lbid++) {
+    uint32_t missing = 0;
+    auto bid = bmap(in, iid, lbid, &missing);
+    if (missing) {
+      // fetch the indirect block first, the rest on a later refill
+      bids.push_back(missing);
+      break;
+    }
+    // holes read as zeros
+    if (bid) bids.push_back(bid);
+  }
+  ra->ahead_ = std::max<uint64_t>(from, lbid * block_size);
+  ra_stats_.issued_ += bids.size();
+  bm_->prefetchAsync(bids);
+}
+
+void InodeManager::prepare_range(const inode& in, uint32_t iid,
+                                 size_t offset, size_t size) const {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  size_t first = offset / block_size;
+  size_t last = (offset + size - 1) / block_size;
+  auto& bids = range_bids_;
+  bids.clear();
+  uint32_t run_start = 0, run_len = 0;
+  for (size_t lbid = first; lbid <= last; lbid++) {
+    auto bid = bmap(in, iid, lbid);
+    // holes read as zeros
+    if (!bid) continue;
+    bids.push_back(bid);
+    if (run_len && bid == run_start + run_len) {
+      run_len++;
+      continue;
+    }
+    if (run_len) bm_->advise(run_start, run_len, MyDisk::Advice::WillNeed);
+    run_start = bid;
+    run_len = 1;
   }
+  if (run_len) bm_->advise(run_start, run_len, MyDisk::Advice::WillNeed);
+  bm_->prefetch(bids);
 }
-size_t InodeManager::write_inode_data_helper(const inode& in, void* src,
-                                             size_t offset, size_t size) const {
+
+uint32_t InodeManager::bmap_alloc(inode& in, uint32_t iid, size_t lbid,
+                                  bool zero) {
   auto slbs = sbm_->readSuperBlock().s_log_block_size_;
   auto block_size = 1024 << slbs;
   auto n_entries = block_size / sizeof(uint32_t);
+  if (!can_alloc(in, lbid)) return 0;
+  if (in.i_flags_ & EXT4_EXTENTS_FL) {
+    auto bid = allocBlock(zero);
+    in.i_blocks_ += 2 << slbs;
+    ext_insert(in, lbid, bid);
+    keep_pointers(in, iid);
+    if (auto map = block_map(iid)) map->insert(lbid, bid);
+    return bid;
+  }
+  if (lbid < NDIRECT_BLOCK) {
+    if (!in.i_block_[lbid]) {
+      in.i_block_[lbid] = allocBlock(zero);
+      in.i_blocks_ += 2 << slbs;
+      keep_pointers(in, iid);
+    }
+    return in.i_block_[lbid];
+  }
+  size_t target = lbid;
+  lbid -= NDIRECT_BLOCK;
+  int level = 1;
+  size_t span = n_entries;
+  while (lbid >= span) {
+    lbid -= span;
+    span *= n_entries;
+    level++;
+  }
+  assert(level <= 3);
+  // a new indirect block must not point at stale data
+  auto new_indirect = [&] {
+    in.i_blocks_ += 2 << slbs;
+    return allocBlock(true);
+  };
+  auto& root = in.i_block_[NDIRECT_BLOCK + level - 1];
+  if (!root) {
+    root = new_indirect();
+    keep_pointers(in, iid);
+  }
+  uint32_t bid = root;
+  for (; level > 0; level--) {
+    span /= n_entries;
+    auto block = bm_->readBlock(bid);
+    auto entry = (uint32_t*)block.s_.get() + lbid / span;
+    lbid %= span;
+    if (!*entry) {
+      if (level > 1) {
+        *entry = new_indirect();
+      } else {
+        *entry = allocBlock(zero);
+        in.i_blocks_ += 2 << slbs;
+      }
+      bm_->writeBlock(block, bid);
+    }
+    bid = *entry;
+  }
+  if (auto map = block_map(iid)) map->insert(target, bid);
+  return bid;
+}
+
+uint32_t InodeManager::data_goal(const inode& in, uint32_t iid,
+                                 size_t lbid) const {
+  if (lbid > 0) {
+    auto prev = bmap(in, iid, lbid - 1);
+    if (prev) return prev + 1;
+  }
+  auto& sb = sbm_->readSuperBlock();
+  auto& gd = bm_->bgd_[(iid - 1) / sb.s_inodes_per_group_];
+  return gd.bg_inode_table_ + sb.s_inodes_per_group_ * sizeof(inode) /
+                                  (1024 << sb.s_log_block_size_);
+}
+
+size_t InodeManager::read_inode_data_helper(const inode& in, uint32_t iid,
+                                            void* dst, size_t offset,
+                                            size_t size) const {
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
   assert(size + (offset % block_size) <= block_size);
-  int used_block = in.i_blocks_ / (2 << slbs);
-  size_t bid = offset / block_size;
-  size_t local_offset = offset % block_size;
+  auto bid = bmap(in, iid, offset / block_size);
+  if (!bid) {
+    // hole
+    memset(dst, 0, size);
+    return size;
+  }
+  assert(bm_->state(bid));
+  auto block = bm_->readBlock(bid);
+  memcpy(dst, block.s_.get() + offset % block_size, size);
+  return size;
+}
+
+uint32_t InodeManager::alloc_data(inode& in, uint32_t iid, size_t lbid,
+                                  size_t last, bool zero) {
+  auto n_entries =
+      (1024 << sbm_->readSuperBlock().s_log_block_size_) / sizeof(uint32_t);
+  // first hole of this write: reserve the rest of it plus room for the
+  // indirect blocks in one go
+  if (prealloc_next_ == prealloc_.size()) {
+    size_t grow = last - lbid + 1;
+    reserveBlocks(data_goal(in, iid, lbid), grow + grow / n_entries + 3);
+  }
+  return bmap_alloc(in, iid, lbid, zero);
+}
+
+void InodeManager::read_direct(const inode& in, uint32_t iid, char* dst,
+                               size_t first, size_t end) const {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto& runs = runs_;
+  runs.clear();
+  for (size_t lbid = first; lbid < end; lbid++) {
+    auto buf = dst + (lbid - first) * block_size;
+    auto bid = bmap(in, iid, lbid);
+    if (!bid) {
+      // hole
+      memset(buf, 0, block_size);
+      continue;
+    }
+    if (!runs.empty()) {
+      auto& run = runs.back();
+      if (run.bid_ + run.count_ == bid &&
+          run.buf_ + run.count_ * block_size == buf) {
+        run.count_++;
+        continue;
+      }
+    }
+    runs.push_back(BlockManager::Run{bid, 1, buf});
+  }
+  bm_->readRuns(runs);
+}
+
+size_t InodeManager::write_direct(inode& in, uint32_t iid, const char* src,
+                                  size_t first, size_t end, size_t last) {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto& runs = runs_;
+  runs.clear();
+  for (size_t lbid = first; lbid < end; lbid++) {
+    auto buf = const_cast<char*>(src) + (lbid - first) * block_size;
+    auto bid = bmap(in, iid, lbid);
+    // overwritten whole, no zeros needed
+    if (!bid) bid = alloc_data(in, iid, lbid, last, eager_zero_);
+    if (!bid) {
+      end = lbid;
+      break;
+    }
+    if (!runs.empty()) {
+      auto& run = runs.back();
+      if (run.bid_ + run.count_ == bid &&
+          run.buf_ + run.count_ * block_size == buf) {
+        run.count_++;
+        continue;
+      }
+    }
+    runs.push_back(BlockManager::Run{bid, 1, buf});
+  }
+  bm_->writeRuns(runs);
+  return end - first;
+}
 
-  if (bid < NDIRECT_BLOCK) {
-    assert(in.i_block_[bid]);
-    assert(bm_->state(in.i_block_[bid]));
-    auto block = bm_->readBlock(in.i_block_[bid]);
-    size_t write_size = std::min(size, block_size - local_offset);
-    memcpy(block.s_.get() + local_offset, src, write_size);
-    bm_->writeBlock(block, in.i_block_[bid]);
-    return write_size;
-  } else if (bid < NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries) {
-    assert(in.i_block_[NDIRECT_BLOCK]);
-    assert(bm_->state(in.i_block_[NDIRECT_BLOCK]));
-    auto b1 = bm_->readBlock(in.i_block_[NDIRECT_BLOCK]);
-    auto local_bid = bid - NDIRECT_BLOCK;
-    auto bid1 = local_bid;
-    assert(*((uint32_t*)b1.s_.get() + bid1));
-    assert(bm_->state(*((uint32_t*)b1.s_.get() + bid1)));
-    auto block = bm_->readBlock(*((uint32_t*)b1.s_.get() + bid1));
-    size_t write_size = std::min(size, block_size - local_offset);
-    memcpy(block.s_.get() + local_offset, src, write_size);
-    bm_->writeBlock(block, *((uint32_t*)b1.s_.get() + bid1));
-    return write_size;
-  } else if (bid < NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                       N2INDIRECT_BLOCK * n_entries * n_entries) {
-    assert(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK]);
-    assert(bm_->state(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK]));
-    auto b1 = bm_->readBlock(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK]);
-    auto local_bid = bid - NDIRECT_BLOCK - N1INDIRECT_BLOCK * n_entries;
-    auto bid1 = local_bid / n_entries;
-    auto bid2 = local_bid % n_entries;
-    assert(*((uint32_t*)b1.s_.get() + bid1));
-    assert(bm_->state(*((uint32_t*)b1.s_.get() + bid1)));
-    auto b2 = bm_->readBlock(*((uint32_t*)b1.s_.get() + bid1));
-    assert(*((uint32_t*)b2.s_.get() + bid2));
-    assert(bm_->state(*((uint32_t*)b2.s_.get() + bid2)));
-    auto block = bm_->readBlock(*((uint32_t*)b2.s_.get() + bid2));
-
-    size_t write_size = std::min(size, block_size - local_offset);
-    memcpy(block.s_.get() + local_offset, src, write_size);
-    bm_->writeBlock(block, *((uint32_t*)b2.s_.get() + bid2));
-    return write_size;
-  } else if (bid < NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                       N2INDIRECT_BLOCK * n_entries * n_entries +
-                       N3INDIRECT_BLOCK * n_entries * n_entries * n_entries) {
-    assert(in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK]);
-    assert(bm_->state(
-        in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK]));
-    auto b1 = bm_->readBlock(
-        in.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK]);
-    auto local_bid = bid - NDIRECT_BLOCK - N1INDIRECT_BLOCK * n_entries -
-                     N2INDIRECT_BLOCK * n_entries * n_entries;
-    auto bid1 = local_bid / n_entries / n_entries;
-    auto bid2 = local_bid / n_entries % n_entries;
-    auto bid3 = local_bid % n_entries;
-    assert(*((uint32_t*)b1.s_.get() + bid1));
-    assert(bm_->state(*((uint32_t*)b1.s_.get() + bid1)));
-    auto b2 = bm_->readBlock(*((uint32_t*)b1.s_.get() + bid1));
-    assert(*((uint32_t*)b2.s_.get() + bid2));
-    assert(bm_->state(*((uint32_t*)b2.s_.get() + bid2)));
-    auto b3 = bm_->readBlock(*((uint32_t*)b2.s_.get() + bid2));
-    assert(*((uint32_t*)b3.s_.get() + bid3));
-    assert(bm_->state(*((uint32_t*)b3.s_.get() + bid3)));
-    auto block = bm_->readBlock(*((uint32_t*)b3.s_.get() + bid3));
-    size_t write_size = std::min(size, block_size - local_offset);
-    memcpy(block.s_.get() + local_offset, src, write_size);
-    bm_->writeBlock(block, *((uint32_t*)b3.s_.get() + bid3));
-    return write_size;
+size_t InodeManager::write_inode_data_helper(inode& in, uint32_t iid,
+                                             const void* src, size_t offset,
+                                             size_t size, size_t last) {
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
+  assert(size + (offset % block_size) <= block_size);
+  size_t lbid = offset / block_size;
+  size_t local_offset = offset % block_size;
+  auto bid = bmap(in, iid, lbid);
+  // only the part of a new block this write leaves alone needs zeros
+  if (!bid)
+    bid = alloc_data(in, iid, lbid, last, eager_zero_ || size != block_size);
+  if (!bid) return 0;
+  FSBlock block;
+  if (size == block_size) {
+    // nothing worth reading
+    block.s_ = BlockPool::get(block_size);
   } else {
-    assert(0);
+    assert(bm_->state(bid));
+    block = bm_->readBlock(bid);
   }
+  memcpy(block.s_.get() + local_offset, src, size);
+  bm_->writeBlock(block, bid);
+  return size;
 }
 
 bool InodeManager::find_next(inode in, const std::string& dir, uint32_t* ret) {
-  for (auto it = dentry_begin(&in); it != dentry_end(&in); ++it) {
-    if (it.cur_dentry_name() == dir) {
+  return dir_find(in, 0, dir, ret);
+}
+
+bool InodeManager::dir_find(const inode& in, uint32_t iid,
+                            const std::string& name, uint32_t* ret) {
+  if (in.i_flags_ & EXT2_INDEX_FL) {
+    BlockPool::Handle leaf;
+    uint32_t lbid;
+    size_t off, prev;
+    if (!dx_locate(in, iid, name, &leaf, &lbid, &off, &prev)) return false;
+    *ret = reinterpret_cast<dentry*>(leaf.get() + off)->inode_;
+    return true;
+  }
+  auto dir = in;
+  for (auto it = dentry_begin(&dir, iid); it != dentry_end(&dir); ++it) {
+    if (it.cur_dentry_name() == name) {
       *ret = it.cur_dentry().inode_;
       return true;
     }
   }
   return false;
 }
-bool InodeManager::dir_add_dentry(uint32_t dst, uint32_t src,
-                                  const std::string& name, uint8_t type) {
+
+bool InodeManager::lookup(uint32_t dir, const std::string& name,
+                          uint32_t* ret) {
+  if (dcache_on_) {
+    auto it = dcache_.find(dir);
+    if (it != dcache_.end()) {
+      auto e = it->second.find(name);
+      if (e != it->second.end()) {
+        if (!e->second) {
+          dcache_stats_.negative_hits_++;
+          return false;
+        }
+        dcache_stats_.hits_++;
+        *ret = e->second;
+        return true;
+      }
+    }
+  }
+  dcache_stats_.misses_++;
+  uint32_t iid = 0;
+  bool found = dir_find(read_inode(dir), dir, name, &iid);
+  dcache_set(dir, name, iid);
+  if (found) *ret = iid;
+  return found;
+}
+
+void InodeManager::forget_dentries(uint32_t dir) {
+  auto it = dcache_.find(dir);
+  if (it == dcache_.end()) return;
+  dcache_size_ -= it->second.size();
+  dcache_.erase(it);
+}
+
+void InodeManager::dentryCache(bool on) {
+  dcache_on_ = on;
+  dcache_.clear();
+  dcache_size_ = 0;
+}
+
+void InodeManager::dcache_set(uint32_t dir, const std::string& name,
+                              uint32_t iid) {
+  if (!dcache_on_) return;
+  if (dcache_size_ >= DCACHE_MAX) {
+    dcache_.clear();
+    dcache_size_ = 0;
+  }
+  if (dcache_[dir].insert_or_assign(name, iid).second) dcache_size_++;
+}
+
+int InodeManager::dir_add_dentry(uint32_t dst, uint32_t src,
+                                 const std::string& name, uint8_t type) {
   auto in = read_inode(dst);
   assert(in.i_mode_ & EXT2_S_IFDIR);
-  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
   // Construct dentry
   assert(name.size() < 256);
   dentry d = {src, static_cast<uint16_t>(UPPER4(sizeof(dentry) + name.size())),
               static_cast<uint8_t>(name.size()), type};
-  if (in.i_size_ % block_size + d.rec_len_ > block_size) {
-    // modify the rec len of the last dentry
-    auto prev = dentry_begin(&in);
-    for (auto it = dentry_begin(&in); it != dentry_end(&in); ++it) {
-      prev = it;
+  if (!(in.i_flags_ & EXT2_INDEX_FL)) {
+    // the first gap left by removed entries that fits
+    auto& space = dir_space(dst);
+    auto gap = std::find_if(space.gaps_.begin(), space.gaps_.end(),
+                            [&](uint16_t g) { return g >= d.rec_len_; });
+    if (gap != space.gaps_.end()) {
+      uint32_t lbid = gap - space.gaps_.begin();
+      size_t end = std::min<size_t>(block_size,
+                                    in.i_size_ - size_t(lbid) * block_size);
+      auto block = dir_read(in, dst, lbid);
+      bool added = leaf_add(block.get(), end, src, name, type);
+      assert(added);
+      dir_write(dst, lbid, block.get());
+      auto& e = lookup_inode(dst);
+      uint32_t live = 0;
+      size_t last;
+      e.gaps_[lbid] = leaf_space(block.get(), end, &live, &last);
+      if (lbid + 1 == e.gaps_.size()) e.last_ = lbid * block_size + last;
+      e.live_ += d.rec_len_;
+      dcache_set(dst, name, src);
+      return 0;
     }
-    auto prev_d = prev.cur_dentry();
-    auto new_rec_len = block_size - prev.offset_ % block_size;
+  }
+  if (!(in.i_flags_ & EXT2_INDEX_FL) && dir_index_ &&
+      in.i_size_ <= block_size && in.i_size_ + d.rec_len_ > block_size) {
+    if (!can_alloc(in, 1)) return -ENOSPC;
+    dx_convert(dst);
+  }
+  if (read_inode(dst).i_flags_ & EXT2_INDEX_FL) {
+    if (int err = dx_add(dst, src, name, type)) return err;
+    auto& e = lookup_inode(dst);
+    if (e.space_) e.live_ += d.rec_len_;
+    dcache_set(dst, name, src);
+    return 0;
+  }
+  // the block the entry lands in if it starts a new one
+  if ((in.i_size_ % block_size == 0 ||
+       in.i_size_ % block_size + d.rec_len_ > block_size) &&
+      !can_alloc(in, (in.i_size_ + block_size - 1) / block_size))
+    return -ENOSPC;
+  if (in.i_size_ % block_size + d.rec_len_ > block_size) {
+    // stretch the last dentry to the end of its block
+    auto& e = lookup_inode(dst);
+    size_t prev = e.last_;
+    dentry prev_d;
+    read_inode_data_helper(in, dst, &prev_d, prev, sizeof(dentry));
+    auto new_rec_len = block_size - prev % block_size;
     auto new_i_size = in.i_size_ + new_rec_len - prev_d.rec_len_;
+    uint16_t used = prev_d.inode_ ? dentry_size(prev_d.name_len_) : 0;
+    auto& gap = e.gaps_[prev / block_size];
+    gap = std::max<uint16_t>(gap, new_rec_len - used);
     prev_d.rec_len_ = new_rec_len;
-    write_inode_data(dst, &prev_d, prev.offset_, sizeof(dentry));
+    write_inode_data(dst, &prev_d, prev, sizeof(dentry));
     resize(dst, new_i_size);
     in = read_inode(dst);
   }
@@ -323,216 +1068,528 @@ bool InodeManager::dir_add_dentry(uint32_t dst, uint32_t src,
   write_inode_data(dst, &d, write_offset, sizeof(dentry));
   write_inode_data(dst, name.c_str(), write_offset + sizeof(dentry),
                    name.size());
-  return true;
+  auto& e = lookup_inode(dst);
+  e.gaps_.resize((write_offset + d.rec_len_ + block_size - 1) / block_size);
+  e.live_ += d.rec_len_;
+  e.last_ = write_offset;
+  dcache_set(dst, name, src);
+  return 0;
 }
 bool InodeManager::dir_del_dentry(uint32_t dst, const std::string& name) {
   auto in = read_inode(dst);
   assert(in.i_mode_ & EXT2_S_IFDIR);
-  auto prev = dentry_begin(&in);
-  for (auto it = dentry_begin(&in); it != dentry_end(&in); ++it) {
-    if (it.cur_dentry_name() == name) {
-      assert(it != dentry_begin(&in));
-      auto prev_dentry = prev.cur_dentry();
-      auto cur_dentry = it.cur_dentry();
-      prev_dentry.rec_len_ += cur_dentry.rec_len_;
-      write_inode_data(dst, &prev_dentry, prev.offset_, sizeof(dentry));
-      return true;
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
+  dir_space(dst);
+  if (in.i_flags_ & EXT2_INDEX_FL) {
+    bool found = dx_del(dst, name);
+    assert(found);
+  } else {
+    size_t off = SIZE_MAX;
+    for (auto it = dentry_begin(&in, dst); it != dentry_end(&in); ++it) {
+      if (it.cur_dentry_name() == name) {
+        off = it.offset_;
+        break;
+      }
+    }
+    assert(off != SIZE_MAX);
+    uint32_t lbid = off / block_size;
+    auto block = dir_read(in, dst, lbid);
+    size_t prev = SIZE_MAX;
+    for (size_t o = 0; o < off % block_size;) {
+      prev = o;
+      o += reinterpret_cast<dentry*>(block.get() + o)->rec_len_;
     }
-    prev = it;
+    auto d = reinterpret_cast<dentry*>(block.get() + off % block_size);
+    auto& e = lookup_inode(dst);
+    // the entry before takes the space over; the first entry of a block,
+    // which has none, is only marked free
+    if (prev == SIZE_MAX) {
+      d->inode_ = 0;
+    } else {
+      reinterpret_cast<dentry*>(block.get() + prev)->rec_len_ += d->rec_len_;
+      if (e.last_ == off) e.last_ = lbid * block_size + prev;
+    }
+    dir_write(dst, lbid, block.get());
+    uint32_t live = 0;
+    size_t last;
+    e.gaps_[lbid] = leaf_space(
+        block.get(),
+        std::min<size_t>(block_size, in.i_size_ - size_t(lbid) * block_size),
+        &live, &last);
   }
-  assert(0);
+  dcache_set(dst, name, 0);
+  auto& e = lookup_inode(dst);
+  e.live_ -= dentry_size(name.size());
+  // mostly gaps: repack the entries. An indexed directory goes back to one
+  // linear block well below the size it was indexed at.
+  size_t blocks = (e.in_.i_size_ + block_size - 1) / block_size;
+  bool sparse = blocks > 1 && 4 * e.live_ < e.in_.i_size_;
+  if (e.in_.i_flags_ & EXT2_INDEX_FL) sparse |= 2 * e.live_ <= block_size;
+  // a repack that freed nothing is not tried again on every removal
+  if (!sparse || uint64_t(e.live_) + block_size > e.stuck_live_) return true;
+  uint32_t live = e.live_;
+  lookup_inode(dst).stuck_live_ = compact_dir(dst) ? UINT32_MAX : live;
+  return true;
 }
 
 bool InodeManager::dir_empty(uint32_t dst) {
   auto in = read_inode(dst);
   assert(in.i_mode_ & EXT2_S_IFDIR);
-  if (in.i_links_count_ == 2) {
-    // only . and ..
-    return true;
+  // i_links_count_ only counts subdirectories: look for any other entry
+  for (auto it = dentry_begin(&in, dst); it != dentry_end(&in); ++it) {
+    auto name = it.cur_dentry_name();
+    if (name != "." && name != "..") return false;
   }
-  for (auto it = dentry_begin(&in); it != dentry_end(&in); ++it) {
-    if (it.cur_dentry_name() != "." && it.cur_dentry_name() != "..") {
-      return false;
+  return true;
+}
+
+uint32_t InodeManager::compact_dir(uint32_t iid) {
+  auto in = read_inode(iid);
+  assert(in.i_mode_ & EXT2_S_IFDIR);
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
+  bool indexed = in.i_flags_ & EXT2_INDEX_FL;
+  size_t blocks = (in.i_size_ + block_size - 1) / block_size;
+  // the live entries one after another, none across a block boundary
+  std::vector<BlockPool::Handle> packed;
+  size_t o = block_size;
+  dentry* last = nullptr;
+  for (auto it = dentry_begin(&in, iid); it != dentry_end(&in); ++it) {
+    auto& d = it.cur_dentry();
+    auto len = dentry_size(d.name_len_);
+    if (o + len > block_size) {
+      if (indexed && !packed.empty()) return rebuild_dir(iid);
+      if (last) last->rec_len_ += block_size - o;
+      packed.push_back(BlockPool::get(block_size));
+      memset(packed.back().get(), 0, block_size);
+      o = 0;
     }
+    last = reinterpret_cast<dentry*>(packed.back().get() + o);
+    memcpy(last, &d, sizeof(dentry) + d.name_len_);
+    last->rec_len_ = len;
+    o += len;
+  }
+  if (!indexed && packed.size() >= blocks) return 0;
+  for (uint32_t i = 0; i < packed.size(); i++)
+    dir_write(iid, i, packed[i].get());
+  resize(iid, (packed.size() - 1) * block_size + o);
+  if (indexed) {
+    in = read_inode(iid);
+    in.i_flags_ &= ~EXT2_INDEX_FL;
+    write_inode(in, iid);
   }
+  lookup_inode(iid).space_ = false;
+  return blocks - packed.size();
+}
+
+uint32_t InodeManager::rebuild_dir(uint32_t iid) {
+  auto in = read_inode(iid);
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  size_t blocks = (in.i_size_ + block_size - 1) / block_size;
+  struct Entry {
+    std::string name_;
+    uint32_t inode_;
+    uint8_t type_;
+  };
+  std::vector<Entry> entries;
+  for (auto it = dentry_begin(&in, iid); it != dentry_end(&in); ++it)
+    entries.push_back(Entry{std::string(it.cur_dentry_name()),
+                            it.cur_dentry().inode_,
+                            it.cur_dentry().file_type_});
+  // empty and linear again; adding the entries back indexes it afresh, with
+  // leaves only as many as they need
+  resize(iid, 0);
+  in = read_inode(iid);
+  in.i_flags_ &= ~EXT2_INDEX_FL;
+  write_inode(in, iid);
+  lookup_inode(iid).space_ = false;
+  for (auto& e : entries) dir_add_dentry(iid, e.inode_, e.name_, e.type_);
+  size_t after = (read_inode(iid).i_size_ + block_size - 1) / block_size;
+  return blocks > after ? blocks - after : 0;
+}
+
+InodeManager::CachedInode& InodeManager::dir_space(uint32_t iid) {
+  auto& e = lookup_inode(iid);
+  if (e.space_) return e;
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  size_t blocks = (e.in_.i_size_ + block_size - 1) / block_size;
+  e.gaps_.assign(blocks, 0);
+  e.live_ = 0;
+  e.last_ = 0;
+  for (size_t lbid = 0; lbid < blocks; lbid++) {
+    auto block = dir_read(e.in_, iid, lbid);
+    size_t end =
+        std::min<size_t>(block_size, e.in_.i_size_ - lbid * block_size);
+    size_t last;
+    e.gaps_[lbid] = leaf_space(block.get(), end, &e.live_, &last);
+    e.last_ = lbid * block_size + last;
+  }
+  e.space_ = true;
+  return e;
+}
+
+BlockPool::Handle InodeManager::dir_read(const inode& in, uint32_t iid,
+                                         uint32_t lbid) const {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto buf = BlockPool::get(block_size);
+  read_inode_data_helper(in, iid, buf.get(), size_t(lbid) * block_size,
+                         block_size);
+  return buf;
+}
+
+void InodeManager::dir_write(uint32_t iid, uint32_t lbid, const char* buf) {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  write_inode_data(iid, buf, size_t(lbid) * block_size, block_size);
+}
+
+uint32_t InodeManager::dir_append(uint32_t iid, const char* buf) {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto size = read_inode(iid).i_size_;
+  assert(size % block_size == 0);
+  resize(iid, size + block_size);
+  dir_write(iid, size / block_size, buf);
+  return size / block_size;
+}
+
+int InodeManager::dx_probe(const inode& in, uint32_t iid, uint32_t hash,
+                           DxFrame* path) const {
+  path[0].lbid_ = 0;
+  path[0].node_ = dir_read(in, iid, 0);
+  auto info = dx_root_info(path[0].node_.get());
+  assert(info->hash_version_ == EXT2_HASH_LEGACY &&
+         info->indirect_levels_ < DX_MAX_DEPTH);
+  int depth = info->indirect_levels_ + 1;
+  for (int i = 0;; i++) {
+    auto entries = dx_entries(path[i].node_.get(), i == 0);
+    path[i].at_ = dx_search(entries, dx_countlimit(entries)->count_, hash);
+    if (i + 1 == depth) return depth;
+    path[i + 1].lbid_ = entries[path[i].at_].block_;
+    path[i + 1].node_ = dir_read(in, iid, path[i + 1].lbid_);
+  }
+}
+
+bool InodeManager::dx_locate(const inode& in, uint32_t iid,
+                             const std::string& name, BlockPool::Handle* leaf,
+                             uint32_t* lbid, size_t* off,
+                             size_t* prev) const {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto hash = dx_hash(name.data(), name.size());
+  DxFrame path[DX_MAX_DEPTH];
+  int depth = dx_probe(in, iid, hash, path);
+  auto& bottom = path[depth - 1];
+  auto entries = dx_entries(bottom.node_.get(), depth == 1);
+  uint32_t count = dx_countlimit(entries)->count_;
+  for (uint32_t at = bottom.at_;; at++) {
+    *lbid = entries[at].block_;
+    *leaf = dir_read(in, iid, *lbid);
+    if (leaf_find(leaf->get(), block_size, name, off, prev)) return true;
+    // names with this hash may go on in the next leaf
+    if (at + 1 == count || entries[at + 1].hash_ != (hash | 1)) return false;
+  }
+}
+
+int InodeManager::dx_add(uint32_t dir, uint32_t src, const std::string& name,
+                         uint8_t type) {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto hash = dx_hash(name.data(), name.size());
+  DxFrame path[DX_MAX_DEPTH];
+  for (;;) {
+    auto in = read_inode(dir);
+    int depth = dx_probe(in, dir, hash, path);
+    auto& bottom = path[depth - 1];
+    uint32_t lbid = dx_entries(bottom.node_.get(), depth == 1)[bottom.at_]
+                        .block_;
+    auto leaf = dir_read(in, dir, lbid);
+    if (leaf_add(leaf.get(), block_size, src, name, type)) {
+      dir_write(dir, lbid, leaf.get());
+      return 0;
+    }
+    // full: move the upper half of the hashes to a new leaf, then try again,
+    // unless the index has no room for the new leaf
+    auto full = [&](int i) {
+      auto countlimit = dx_countlimit(dx_entries(path[i].node_.get(), !i));
+      return countlimit->count_ == countlimit->limit_;
+    };
+    if (depth == DX_MAX_DEPTH && full(0) && full(1)) return -ENOSPC;
+    // the new leaf, and a new index node if one splits
+    if (!can_alloc(in, in.i_size_ / block_size, 2)) return -ENOSPC;
+    auto entries = leaf_entries(leaf.get(), 0, block_size);
+    assert(entries.size() > 1);
+    std::sort(entries.begin(), entries.end());
+    size_t total = 0, half = 0, split = 1;
+    for (auto& e : entries) {
+      auto d = reinterpret_cast<const dentry*>(leaf.get() + e.second);
+      total += dentry_size(d->name_len_);
+    }
+    for (; split < entries.size() - 1; split++) {
+      auto d = reinterpret_cast<const dentry*>(leaf.get() +
+                                               entries[split - 1].second);
+      half += dentry_size(d->name_len_);
+      if (2 * half >= total) break;
+    }
+    // a hash must not straddle two leaves unless it fills the whole block:
+    // take the nearest boundary between two hashes
+    auto boundary = [&](size_t i) {
+      return i > 0 && i < entries.size() &&
+             entries[i].first != entries[i - 1].first;
+    };
+    size_t lo = split, hi = split;
+    while (lo > 0 && !boundary(lo)) lo--;
+    while (hi < entries.size() && !boundary(hi)) hi++;
+    uint32_t split_hash;
+    if (lo || hi < entries.size()) {
+      split = !lo || (hi < entries.size() && hi - split < split - lo) ? hi : lo;
+      split_hash = entries[split].first;
+    } else {
+      split_hash = entries[split].first | 1;
+    }
+    auto lower = BlockPool::get(block_size);
+    auto upper = BlockPool::get(block_size);
+    leaf_pack(leaf.get(), entries.begin(), entries.begin() + split,
+              lower.get(), block_size);
+    leaf_pack(leaf.get(), entries.begin() + split, entries.end(), upper.get(),
+              block_size);
+    dir_write(dir, lbid, lower.get());
+    uint32_t new_lbid = dir_append(dir, upper.get());
+    if (int err = dx_insert_entry(dir, path, depth, split_hash, new_lbid))
+      return err;
+  }
+}
+
+int InodeManager::dx_insert_entry(uint32_t dir, DxFrame* path, int depth,
+                                  uint32_t hash, uint32_t block) {
+  auto block_size = 1024 << sbm_->readSuperBlock().s_log_block_size_;
+  auto& bottom = path[depth - 1];
+  auto entries = dx_entries(bottom.node_.get(), depth == 1);
+  auto countlimit = dx_countlimit(entries);
+  if (countlimit->count_ < countlimit->limit_) {
+    auto at = bottom.at_ + 1;
+    memmove(entries + at + 1, entries + at,
+            (countlimit->count_ - at) * sizeof(Dx_Entry));
+    entries[at] = Dx_Entry{hash, block};
+    countlimit->count_++;
+    dir_write(dir, bottom.lbid_, bottom.node_.get());
+    return 0;
+  }
+  if (depth == 1) {
+    // a full root moves its entries to a new node below it
+    auto node = BlockPool::get(block_size);
+    dx_init_node(node.get(), block_size);
+    auto node_entries = dx_entries(node.get(), false);
+    auto limit = dx_countlimit(node_entries)->limit_;
+    memcpy(node_entries, entries, countlimit->count_ * sizeof(Dx_Entry));
+    dx_countlimit(node_entries)->limit_ = limit;
+    uint32_t node_lbid = dir_append(dir, node.get());
+    countlimit->count_ = 1;
+    entries[0].block_ = node_lbid;
+    dx_root_info(bottom.node_.get())->indirect_levels_ = 1;
+    dir_write(dir, 0, bottom.node_.get());
+    path[1] = DxFrame{node_lbid, std::move(node), bottom.at_};
+    path[0].at_ = 0;
+    return dx_insert_entry(dir, path, 2, hash, block);
+  }
+  static_assert(DX_MAX_DEPTH == 2, "only the root is above a node");
+  auto& root = path[0];
+  auto root_entries = dx_entries(root.node_.get(), true);
+  auto root_countlimit = dx_countlimit(root_entries);
+  if (root_countlimit->count_ == root_countlimit->limit_) return -ENOSPC;
+  // split the node in two, not between a hash and its continuation
+  uint32_t count = countlimit->count_, split = count / 2;
+  while (split < count && entries[split].hash_ & 1) split++;
+  if (split == count)
+    for (split = count / 2; split > 1 && entries[split].hash_ & 1;) split--;
+  uint32_t split_hash = entries[split].hash_;
+  auto node = BlockPool::get(block_size);
+  dx_init_node(node.get(), block_size);
+  auto node_entries = dx_entries(node.get(), false);
+  auto limit = dx_countlimit(node_entries)->limit_;
+  memcpy(node_entries, entries + split, (count - split) * sizeof(Dx_Entry));
+  dx_countlimit(node_entries)->limit_ = limit;
+  dx_countlimit(node_entries)->count_ = count - split;
+  countlimit->count_ = split;
+  dir_write(dir, bottom.lbid_, bottom.node_.get());
+  uint32_t node_lbid = dir_append(dir, node.get());
+  root.at_++;
+  memmove(root_entries + root.at_ + 1, root_entries + root.at_,
+          (root_countlimit->count_ - root.at_) * sizeof(Dx_Entry));
+  root_entries[root.at_] = Dx_Entry{split_hash, node_lbid};
+  root_countlimit->count_++;
+  dir_write(dir, 0, root.node_.get());
+  // continue in the half holding the entry followed
+  if (bottom.at_ >= split) {
+    bottom = DxFrame{node_lbid, std::move(node), bottom.at_ - split};
+  } else {
+    root.at_--;
+  }
+  return dx_insert_entry(dir, path, depth, hash, block);
+}
+
+bool InodeManager::dx_del(uint32_t dir, const std::string& name) {
+  BlockPool::Handle leaf;
+  uint32_t lbid;
+  size_t off, prev;
+  if (!dx_locate(read_inode(dir), dir, name, &leaf, &lbid, &off, &prev))
+    return false;
+  auto d = reinterpret_cast<dentry*>(leaf.get() + off);
+  if (prev == SIZE_MAX)
+    d->inode_ = 0;
+  else
+    reinterpret_cast<dentry*>(leaf.get() + prev)->rec_len_ += d->rec_len_;
+  dir_write(dir, lbid, leaf.get());
   return true;
 }
 
+void InodeManager::dx_convert(uint32_t dir) {
+  auto block_size = 1024u << sbm_->readSuperBlock().s_log_block_size_;
+  auto in = read_inode(dir);
+  assert(in.i_size_ <= block_size);
+  auto old = dir_read(in, dir, 0);
+  auto dot = reinterpret_cast<const dentry*>(old.get());
+  auto dotdot = reinterpret_cast<const dentry*>(old.get() + dot->rec_len_);
+  assert(dot->name_len_ == 1 && dotdot->name_len_ == 2);
+  // everything but "." and ".." moves to the first leaf
+  auto entries = leaf_entries(
+      old.get(), dot->rec_len_ + dotdot->rec_len_, in.i_size_);
+  std::sort(entries.begin(), entries.end());
+  auto leaf = BlockPool::get(block_size);
+  leaf_pack(old.get(), entries.begin(), entries.end(), leaf.get(),
+            block_size);
+
+  auto root = BlockPool::get(block_size);
+  memset(root.get(), 0, block_size);
+  auto d = reinterpret_cast<dentry*>(root.get());
+  *d = dentry{dir, 12, 1, EXT2_FT_DIR};
+  memcpy(d + 1, ".", 1);
+  d = reinterpret_cast<dentry*>(root.get() + 12);
+  *d = dentry{dotdot->inode_, uint16_t(block_size - 12), 2, EXT2_FT_DIR};
+  memcpy(d + 1, "..", 2);
+  auto info = dx_root_info(root.get());
+  info->hash_version_ = EXT2_HASH_LEGACY;
+  info->info_length_ = sizeof(Dx_Root_Info);
+  auto root_entries = dx_entries(root.get(), true);
+  dx_countlimit(root_entries)->limit_ =
+      (block_size - DX_ROOT_ENTRIES) / sizeof(Dx_Entry);
+  dx_countlimit(root_entries)->count_ = 1;
+
+  resize(dir, block_size);
+  root_entries[0].block_ = dir_append(dir, leaf.get());
+  dir_write(dir, 0, root.get());
+  in = read_inode(dir);
+  in.i_flags_ |= EXT2_INDEX_FL;
+  write_inode(in, dir);
+  // the gaps no longer describe the blocks
+  lookup_inode(dir).space_ = false;
+}
+
 void InodeManager::resize(int iid, uint32_t size) {
   auto inode = read_inode(iid);
   auto slbs = sbm_->readSuperBlock().s_log_block_size_;
   auto block_size = 1024 << slbs;
   auto n_entries = block_size / sizeof(uint32_t);
-  int used_block = inode.i_blocks_ / (2 << slbs);
+  size_t used_block = (inode.i_size_ + block_size - 1) / block_size;
+  size_t after_block = (size + block_size - 1) / block_size;
 
-  int after_block = (size + block_size - 1) / block_size;
+  // bytes past the end of the last block must read back as zeros if the file
+  // grows again
+  if (size < inode.i_size_ && size % block_size) {
+    auto bid = bmap(inode, iid, size / block_size);
+    if (bid) {
+      auto block = bm_->readBlock(bid);
+      memset(block.s_.get() + size % block_size, 0,
+             block_size - size % block_size);
+      bm_->writeBlock(block, bid);
+    }
+  }
 
-  if (used_block == after_block) {
-    inode.i_size_ = size;
-    write_inode(inode, iid);
-    return;
+  if (used_block > after_block && inode.i_flags_ & EXT4_EXTENTS_FL) {
+    uint32_t freed = 0;
+    auto root = ext_node(inode.i_block_);
+    // emptied: back to a root leaf
+    if (ext_truncate(root, after_block, &freed)) root->eh_depth_ = 0;
+    inode.i_blocks_ -= freed * (2 << slbs);
+    if (auto map = block_map(iid)) map->erase(after_block, UINT32_MAX);
+    bm_->freeDeferred();
   } else if (used_block > after_block) {
+    uint32_t freed = 0;
     // Free direct blocks
-    for (int i = after_block; i < used_block && i < NDIRECT_BLOCK; ++i) {
-      assert(inode.i_block_[i]);
-      bm_->tagBlock(inode.i_block_[i], 0);
+    for (size_t i = after_block; i < used_block && i < NDIRECT_BLOCK; ++i) {
+      if (!inode.i_block_[i]) continue;
+      bm_->deferFree(inode.i_block_[i]);
       inode.i_block_[i] = 0;
+      freed++;
     }
-
-    // Free indirect blocks
-    if (used_block > NDIRECT_BLOCK) {
-      unsigned int start =
-          (after_block > NDIRECT_BLOCK) ? after_block - NDIRECT_BLOCK : 0;
-      unsigned int end =
-          used_block - NDIRECT_BLOCK > N1INDIRECT_BLOCK * n_entries
-              ? N1INDIRECT_BLOCK * n_entries
-              : used_block - NDIRECT_BLOCK;
-      if (free_indirect_blocks(inode.i_block_[NDIRECT_BLOCK], 1, start, end))
-        inode.i_block_[NDIRECT_BLOCK] = 0;
-    }
-
-    // Free double indirect blocks
-    if (used_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries) {
-      unsigned int start =
-          after_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries
-              ? after_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries)
-              : 0;
-      unsigned int end =
-          used_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries) >
-                  N2INDIRECT_BLOCK * n_entries * n_entries
-              ? N2INDIRECT_BLOCK * n_entries * n_entries
-              : used_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries);
-      if (free_indirect_blocks(inode.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK],
-                               2, start, end))
-        inode.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK] = 0;
-    }
-
-    // Free triple indirect blocks
-    if (used_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                         N2INDIRECT_BLOCK * n_entries * n_entries) {
-      unsigned int start =
-          after_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                            N2INDIRECT_BLOCK * n_entries * n_entries
-              ? after_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                               N2INDIRECT_BLOCK * n_entries * n_entries)
-              : 0;
-      unsigned int end =
-          used_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                        N2INDIRECT_BLOCK * n_entries * n_entries) >
-                  N3INDIRECT_BLOCK * n_entries * n_entries * n_entries
-              ? N3INDIRECT_BLOCK * n_entries * n_entries * n_entries
-              : used_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                              N2INDIRECT_BLOCK * n_entries * n_entries);
-      if (free_indirect_blocks(inode.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK +
-                                              N2INDIRECT_BLOCK],
-                               3, start, end))
-        inode.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK] = 0;
-    }
-  } else {
-    // for (int i = used_block; i < after_block; i++) {
-    //   allocate_data(inode, i);
-    // }
-
-    // Allocate direct blocks
-    for (int i = used_block; i < after_block && i < NDIRECT_BLOCK; ++i) {
-      allocate_indirect_blocks(&inode.i_block_[i], 0, 0, 1);
-    }
-    // Allocate indirect blocks
-    if (after_block > NDIRECT_BLOCK) {
-      unsigned int start =
-          (used_block > NDIRECT_BLOCK) ? used_block - NDIRECT_BLOCK : 0;
-      unsigned int end =
-          after_block - NDIRECT_BLOCK > N1INDIRECT_BLOCK * n_entries
-              ? N1INDIRECT_BLOCK * n_entries
-              : after_block - NDIRECT_BLOCK;
-      allocate_indirect_blocks(&inode.i_block_[NDIRECT_BLOCK], 1, start, end);
-    }
-    // Allocate double indirect blocks
-    if (after_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries) {
-      unsigned int start =
-          used_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries
-              ? used_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries)
-              : 0;
-      unsigned int end =
-          after_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries) >
-                  N2INDIRECT_BLOCK * n_entries * n_entries
-              ? N2INDIRECT_BLOCK * n_entries * n_entries
-              : after_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries);
-      allocate_indirect_blocks(
-          &inode.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK], 2, start, end);
-    }
-    // Allocate triple indirect blocks
-    if (after_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                          N2INDIRECT_BLOCK * n_entries * n_entries) {
-      unsigned int start =
-          used_block > NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                           N2INDIRECT_BLOCK * n_entries * n_entries
-              ? used_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                              N2INDIRECT_BLOCK * n_entries * n_entries)
-              : 0;
-      unsigned int end =
-          after_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                         N2INDIRECT_BLOCK * n_entries * n_entries) >
-                  N3INDIRECT_BLOCK * n_entries * n_entries * n_entries
-              ? N3INDIRECT_BLOCK * n_entries * n_entries * n_entries
-              : after_block - (NDIRECT_BLOCK + N1INDIRECT_BLOCK * n_entries +
-                               N2INDIRECT_BLOCK * n_entries * n_entries);
-      allocate_indirect_blocks(
-          &inode.i_block_[NDIRECT_BLOCK + N1INDIRECT_BLOCK + N2INDIRECT_BLOCK],
-          3, start, end);
+    // Free single, double and triple indirect blocks, each covering the
+    // logical blocks [base, base + span)
+    size_t base = NDIRECT_BLOCK, span = n_entries;
+    for (int level = 1; level <= 3; level++) {
+      auto& root = inode.i_block_[NDIRECT_BLOCK + level - 1];
+      size_t start = after_block > base ? after_block - base : 0;
+      size_t end = used_block > base ? std::min(used_block - base, span) : 0;
+      if (root && start < end &&
+          free_indirect_blocks(root, level, start, end, &freed))
+        root = 0;
+      base += span;
+      span *= n_entries;
     }
+    inode.i_blocks_ -= freed * (2 << slbs);
+    if (auto map = block_map(iid)) map->erase(after_block, UINT32_MAX);
+    bm_->freeDeferred();
   }
+  keep_pointers(inode, iid);
+  // the gaps of a shrunken directory are scanned again
+  if (size < inode.i_size_) lookup_inode(iid).space_ = false;
+  // growing leaves a hole: blocks are allocated when they are written
   inode.i_size_ = size;
-  inode.i_blocks_ = (size + block_size - 1) / block_size * (2 << slbs);
   write_inode(inode, iid);
 }
 
-void InodeManager::allocate_indirect_blocks(uint32_t* dst, int level,
-                                            size_t start, size_t end) {
-  assert(level >= 0);
-  if (*dst)
-    assert(bm_->state(*dst));
-  else
-    *dst = bm_->getIdleBlock();
-  if (level == 0) return;
-  auto n_entries =
-      (1024 << sbm_->readSuperBlock().s_log_block_size_) / sizeof(uint32_t);
-  int level_entries = 1;
-  for (int i = 1; i < level; ++i) level_entries *= n_entries;
+void InodeManager::reserveBlocks(uint32_t goal, size_t count) {
+  prealloc_.clear();
+  prealloc_next_ = 0;
+  count = std::min<size_t>(count, bm_->freeBlocks());
+  while (count) {
+    uint32_t len;
+    auto first = bm_->getIdleRun(goal, count, &len);
+    for (uint32_t i = 0; i < len; i++) prealloc_.push_back(first + i);
+    goal = first + len;
+    count -= len;
+  }
+  alloc_goal_ = goal;
+}
 
-  size_t start_index = start / level_entries;
-  size_t end_index = (end - 1) / level_entries;
-  unsigned int sub_start, sub_end;
-  auto block = bm_->readBlock(*dst);
+uint32_t InodeManager::allocBlock(bool zero) {
+  if (prealloc_next_ == prealloc_.size()) reserveBlocks(alloc_goal_, 1);
+  if (prealloc_next_ == prealloc_.size()) return 0;
+  auto bid = prealloc_[prealloc_next_++];
+  alloc_goal_ = bid + 1;
+  if (zero) bm_->zeroBlocks(bid, 1);
+  return bid;
+}
 
-  for (size_t i = start_index; i <= end_index; ++i) {
-    auto entry = (uint32_t*)block.s_.get() + i;
-    sub_start = (i == start_index) ? start % level_entries : 0;
-    sub_end = (i == end_index) ? end % level_entries : level_entries;
-    allocate_indirect_blocks(entry, level - 1, sub_start, sub_end);
-  }
-  bm_->writeBlock(block, *dst);
+bool InodeManager::can_alloc(const inode& in, size_t lbid,
+                             size_t count) const {
+  // past the direct pointers a block may need a chain of three indirect
+  // blocks; in an extent tree, a split at every level and a new root
+  size_t each = in.i_flags_ & EXT4_EXTENTS_FL
+                    ? ext_node(in.i_block_)->eh_depth_ + 2
+                : lbid + count > NDIRECT_BLOCK ? 4
+                                               : 1;
+  return prealloc_.size() - prealloc_next_ + bm_->freeBlocks() >=
+         count * each;
+}
+
+void InodeManager::releaseBlocks() {
+  for (; prealloc_next_ < prealloc_.size(); prealloc_next_++)
+    bm_->deferFree(prealloc_[prealloc_next_]);
+  bm_->freeDeferred();
+  prealloc_.clear();
+  prealloc_next_ = 0;
 }
 
 bool InodeManager::free_indirect_blocks(uint32_t bid, int level, size_t start,
-                                        size_t end) {
+                                        size_t end, uint32_t* freed) {
   auto block = bm_->readBlock(bid);
   auto n_entries =
       (1024 << sbm_->readSuperBlock().s_log_block_size_) / sizeof(uint32_t);
-  if (level == 1) {
-    for (size_t i = start; i < end; i++) {
-      auto entry = *((uint32_t*)block.s_.get() + i);
-      assert(entry);
-      bm_->tagBlock(entry, 0);
-      *((uint32_t*)block.s_.get() + i) = 0;
-    }
-    if (start == 0) {
-      bm_->tagBlock(bid, 0);
-      return true;
-    }
-    return false;
-  }
-
   int level_entries = 1;
   for (int i = 1; i < level; ++i) {
     level_entries *= n_entries;
@@ -542,52 +1599,77 @@ bool InodeManager::free_indirect_blocks(uint32_t bid, int level, size_t start,
   size_t end_index = (end - 1) / level_entries;
   unsigned int sub_start, sub_end;
 
-  for (size_t i = start_index; i < end_index; ++i) {
-    auto entry = *((uint32_t*)block.s_.get() + i);
-    assert(entry);
+  for (size_t i = start_index; i <= end_index; ++i) {
+    auto entry = (uint32_t*)block.s_.get() + i;
+    // hole
+    if (!*entry) continue;
+    if (level == 1) {
+      bm_->deferFree(*entry);
+      (*freed)++;
+      *entry = 0;
+      continue;
+    }
     sub_start = (i == start_index) ? start % level_entries : 0;
-    sub_end = (i == end_index) ? end % level_entries : level_entries;
-    if (free_indirect_blocks(entry, level - 1, sub_start, sub_end))
-      *((uint32_t*)block.s_.get() + i) = 0;
+    sub_end = (i == end_index) ? (end - 1) % level_entries + 1 : level_entries;
+    if (free_indirect_blocks(*entry, level - 1, sub_start, sub_end, freed))
+      *entry = 0;
   }
-  bm_->writeBlock(block, bid);
-  if (start_index == 0) {
-    bm_->tagBlock(bid, 0);
+  if (start == 0) {
+    bm_->deferFree(bid);
+    (*freed)++;
     return true;
   }
+  bm_->writeBlock(block, bid);
   return false;
 }
 
 InodeManager::dentry_iterator::dentry_iterator(inode* in, InodeManager* im,
-                                               size_t offset)
-    : dinode_(in), im_(im), offset_(offset) {}
-
-dentry InodeManager::dentry_iterator::cur_dentry() const {
-  assert(offset_ != dinode_->i_size_);
-  dentry ret;
-  auto read_size =
-      im_->read_inode_data_helper(*dinode_, &ret, offset_, sizeof(dentry));
-  assert(read_size == sizeof(dentry));
-  return ret;
+                                               size_t offset, uint32_t iid)
+    : dinode_(in),
+      im_(im),
+      offset_(offset),
+      iid_(iid),
+      block_size_(1024 << im->sbm_->readSuperBlock().s_log_block_size_),
+      block_(),
+      lbid_(SIZE_MAX) {
+  settle();
 }
-std::string InodeManager::dentry_iterator::cur_dentry_name() const {
-  assert(offset_ != dinode_->i_size_);
-  auto dentry = cur_dentry();
-  char name[256];
-  auto read_size = im_->read_inode_data_helper(
-      *dinode_, name, offset_ + sizeof(dentry), dentry.name_len_);
-  assert(read_size == dentry.name_len_);
-  return std::string(name, dentry.name_len_);
+
+void InodeManager::dentry_iterator::settle() {
+  while (offset_ < dinode_->i_size_) {
+    if (offset_ / block_size_ != lbid_) {
+      lbid_ = offset_ / block_size_;
+      block_ = im_->dir_read(*dinode_, iid_, lbid_);
+    }
+    auto& d = cur_dentry();
+    // entries without an inode are free space or index nodes
+    if (d.inode_) return;
+    assert(d.rec_len_);
+    offset_ += d.rec_len_;
+  }
+  offset_ = dinode_->i_size_;
 }
+
+const dentry& InodeManager::dentry_iterator::cur_dentry() const {
+  assert(offset_ < dinode_->i_size_);
+  return *reinterpret_cast<const dentry*>(block_.get() +
+                                          offset_ % block_size_);
+}
+
+std::string_view InodeManager::dentry_iterator::cur_dentry_name() const {
+  auto& d = cur_dentry();
+  return std::string_view(dentry_name(&d), d.name_len_);
+}
+
 InodeManager::dentry_iterator& InodeManager::dentry_iterator::operator++() {
-  assert(offset_ != dinode_->i_size_);
-  auto dentry = cur_dentry();
-  offset_ += dentry.rec_len_;
+  offset_ += cur_dentry().rec_len_;
+  settle();
   return *this;
 }
 
-InodeManager::dentry_iterator InodeManager::dentry_begin(inode* in) {
-  return InodeManager::dentry_iterator(in, this, 0);
+InodeManager::dentry_iterator InodeManager::dentry_begin(inode* in,
+                                                         uint32_t iid) {
+  return InodeManager::dentry_iterator(in, this, 0, iid);
 }
 InodeManager::dentry_iterator InodeManager::dentry_end(inode* in) {
   return InodeManager::dentry_iterator(in, this, in->i_size_);
@@ -595,16 +1677,10 @@ InodeManager::dentry_iterator InodeManager::dentry_end(inode* in) {
 
 bool operator==(const InodeManager::dentry_iterator& lhs,
                 const InodeManager::dentry_iterator& rhs) {
-  if (memcmp(lhs.dinode_, rhs.dinode_, sizeof(inode)) != 0) {
-    return false;
-  }
   return lhs.offset_ == rhs.offset_;
 }
 
 bool operator!=(const InodeManager::dentry_iterator& lhs,
                 const InodeManager::dentry_iterator& rhs) {
-  if (memcmp(lhs.dinode_, rhs.dinode_, sizeof(inode)) != 0) {
-    return true;
-  }
   return lhs.offset_ != rhs.offset_;
 }
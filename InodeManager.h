@@ -1,23 +1,85 @@
+#include <string_view>
+#include <unordered_map>
+
 #include "BlockManager.h"
+#include "BlockMap.h"
 class InodeManager {
  public:
+  struct CacheStats {
+    uint64_t hits_;
+    uint64_t misses_;
+    // inode-table blocks written back
+    uint64_t writebacks_;
+    // indirect mappings answered by the block map, and indirect walks
+    uint64_t map_hits_;
+    uint64_t map_walks_;
+  };
+  // Sequential readahead state of one open file, kept by the caller and
+  // zero-initialized on open.
+  struct Readahead {
+    // byte offset right after the last read
+    uint64_t next_;
+    // end of what has been requested ahead
+    uint64_t ahead_;
+    uint32_t window_;
+  };
+  struct ReadaheadStats {
+    // reads continuing the previous one, and reads elsewhere
+    uint64_t sequential_;
+    uint64_t random_;
+    // blocks requested ahead
+    uint64_t issued_;
+    uint32_t peak_window_;
+  };
+  struct DentryStats {
+    // lookups answered by a cached entry, by a cached absence, and by
+    // scanning the directory
+    uint64_t hits_;
+    uint64_t negative_hits_;
+    uint64_t misses_;
+  };
+
   InodeManager(std::shared_ptr<SuperBlockManager>,
-               std::shared_ptr<BlockManager>);
+               std::shared_ptr<BlockManager>, size_t cacheInodes = 4096);
+  ~InodeManager();
   bool getIdleInode(uint32_t* iid);
   uint32_t new_inode(const inode& in);
   bool del_inode(uint32_t iid);
   inode read_inode(uint32_t iid) const;
 
-  size_t read_inode_data(uint32_t iid, void* dst, size_t offset,
-                         size_t size) const;
+  // With ra, sequential reads start reading the blocks after them in the
+  // background, in a window that grows while the reads stay sequential.
+  size_t read_inode_data(uint32_t iid, void* dst, size_t offset, size_t size,
+                         Readahead* ra = nullptr) const;
 
+  // Blocks inside holes are allocated on first write. Returns the bytes
+  // written, fewer than size when the disk fills up.
   size_t write_inode_data(uint32_t iid, const void* src, size_t offset,
-                          size_t size) const;
-
-  // didn't writeback inode
-  void allocate_data(inode& in, size_t bid);
+                          size_t size);
 
+  // Inodes are cached: write_inode only updates the cached copy, and the
+  // inode table is written in flush() or when the cache is full.
   bool write_inode(const inode& in, uint32_t iid);
+  // An acquired inode stays cached until every reference is released, e.g.
+  // while a file is open.
+  void acquire_inode(uint32_t iid);
+  void release_inode(uint32_t iid);
+  // writes back the dirty inodes, each inode-table block once, then flushes
+  // the block layer
+  bool flush();
+  const CacheStats& inodeCacheStats() const { return icache_stats_; }
+  // Zero every new data block when it is allocated, even when the write that
+  // allocates it covers the whole block. Off by default; for measurements.
+  void eagerZero(bool on) { eager_zero_ = on; }
+  // New inodes map their blocks with an extent tree (EXT4_EXTENTS_FL) unless
+  // this is turned off; existing inodes keep the format they have.
+  void useExtents(bool on) { extents_ = on; }
+  // Directories outgrowing their first block get a hashed index
+  // (EXT2_INDEX_FL) unless this is turned off.
+  void useDirIndex(bool on) { dir_index_ = on; }
+  // largest readahead window in bytes, 0 turns readahead off
+  void readaheadLimit(uint32_t bytes) { ra_max_ = bytes; }
+  const ReadaheadStats& readaheadStats() const { return ra_stats_; }
   /**
    * @brief Find the dentry with the given name in the given directory.
    *
@@ -26,6 +88,16 @@ class InodeManager {
    * @param ret The inode ID of the dentry to be found.
    */
   bool find_next(inode in, const std::string& dir, uint32_t* ret = nullptr);
+  // find_next through the dentry cache, which also remembers the names a
+  // directory does not have. Kept in step by dir_add_dentry, dir_del_dentry
+  // and del_inode.
+  bool lookup(uint32_t dir, const std::string& name, uint32_t* ret);
+  // drops the cached names of directory dir, for changes made around
+  // dir_add_dentry and dir_del_dentry
+  void forget_dentries(uint32_t dir);
+  // On by default; off, every lookup scans the directory. For measurements.
+  void dentryCache(bool on);
+  const DentryStats& dentryStats() const { return dcache_stats_; }
   /**
    * @brief Add a directory entry to a directory inode.
    *
@@ -33,24 +105,42 @@ class InodeManager {
    * @param iid The inode ID of the dentry to be added.
    * @param name The name of the dentry to be added.
    * @param type The type of the dentry to be added.
+   * @return 0, or -ENOSPC when the directory cannot grow: no free block for
+   * it, or no room left in its index for another leaf.
    */
-  bool dir_add_dentry(uint32_t dst, uint32_t src, const std::string& name,
+  int dir_add_dentry(uint32_t dst, uint32_t src, const std::string& name,
                       uint8_t type);
+  // Removing an entry leaves a gap that dir_add_dentry reuses; a directory
+  // mostly made of gaps is compacted.
   bool dir_del_dentry(uint32_t dst, const std::string& name);
   bool dir_empty(uint32_t dst);
+  // Packs the entries of a linear directory into as few blocks as they fit
+  // and frees the rest; an indexed directory whose entries fit in one block
+  // goes back to being linear, a larger one has its index rebuilt. Returns
+  // the number of blocks freed, 0 if the directory was left alone.
+  uint32_t compact_dir(uint32_t iid);
 
+  // Growing only moves i_size_, leaving a hole; shrinking frees the mapped
+  // blocks past the new end.
   void resize(int iid, uint32_t size);
-  bool free_indirect_blocks(uint32_t bid, int level, size_t start, size_t end);
-  void allocate_indirect_blocks(uint32_t* dst, int level, size_t start,
-                                size_t end);
+  // queues the mapped entries [start, end) below bid to be freed, adding
+  // their number to *freed; true if bid itself was freed
+  bool free_indirect_blocks(uint32_t bid, int level, size_t start, size_t end,
+                            uint32_t* freed);
 
+  // Walks the entries of a directory that have an inode. Each block is read
+  // once and its entries parsed in place: the current entry and its name
+  // stay valid until the iterator moves to another block. With iid the
+  // blocks are found through the inode's block map; iid 0 as for bmap.
   class dentry_iterator {
    public:
-    dentry_iterator(inode* in, InodeManager* im, size_t offset = 0);
+    dentry_iterator(inode* in, InodeManager* im, size_t offset = 0,
+                    uint32_t iid = 0);
 
     dentry_iterator& operator++();
-    dentry cur_dentry() const;
-    std::string cur_dentry_name() const;
+    const dentry& cur_dentry() const;
+    std::string_view cur_dentry_name() const;
+    // iterators over the same directory compare by offset
     friend bool operator==(const dentry_iterator& lhs,
                            const dentry_iterator& rhs);
     friend bool operator!=(const dentry_iterator& lhs,
@@ -59,15 +149,172 @@ class InodeManager {
     inode* dinode_;
     InodeManager* im_;
     size_t offset_;
+
+   private:
+    // loads the block holding offset_ if needed and moves past entries
+    // without an inode
+    void settle();
+    uint32_t iid_;
+    uint32_t block_size_;
+    // the block loaded and its logical block
+    BlockPool::Handle block_;
+    size_t lbid_;
   };
-  dentry_iterator dentry_begin(inode* in);
+  dentry_iterator dentry_begin(inode* in, uint32_t iid = 0);
   dentry_iterator dentry_end(inode* in);
 
  private:
   std::shared_ptr<BlockManager> bm_;
   std::shared_ptr<SuperBlockManager> sbm_;
-  size_t read_inode_data_helper(const inode& in, void* dst, size_t offset,
-                                size_t size) const;
-  size_t write_inode_data_helper(const inode& in, void* src, size_t offset,
-                                 size_t size) const;
+  // scratch for prepare_range, read_direct and write_direct
+  mutable std::vector<uint32_t> range_bids_;
+  mutable std::vector<BlockManager::Run> runs_;
+
+  struct CachedInode {
+    inode in_;
+    uint32_t refs_;
+    bool dirty_;
+    // mappings below the indirect blocks, filled as bmap walks them
+    BlockMap map_;
+    // Directories: the largest gap in each block, the bytes taken by
+    // entries and the offset of the last entry, scanned by dir_space on
+    // first use.
+    std::vector<uint16_t> gaps_;
+    uint32_t live_;
+    uint32_t last_;
+    bool space_;
+    // live_ when compacting last freed nothing; compaction waits until a
+    // block's worth of entries more is gone, UINT32_MAX when it need not
+    uint32_t stuck_live_;
+  };
+  // the cached copy of iid, read from the inode table on a miss
+  CachedInode& lookup_inode(uint32_t iid) const;
+  // inode-table block holding iid, and the inode's index within it
+  std::pair<uint32_t, uint32_t> inode_location(uint32_t iid) const;
+  // writes every dirty inode back; with evict also drops the unreferenced
+  // ones
+  void writeback_inodes(bool evict) const;
+  // block map of a cached inode; nullptr for iid 0 or an uncached inode
+  BlockMap* block_map(uint32_t iid) const;
+  // copies pointers changed by bmap_alloc or resize, which keep the block map
+  // in step themselves, into the cached inode so write_inode keeps its maps
+  void keep_pointers(const inode& in, uint32_t iid);
+  mutable std::unordered_map<uint32_t, CachedInode> icache_;
+  size_t icache_capacity_;
+  mutable CacheStats icache_stats_;
+  // blocks reserved by resize, handed out in order by allocBlock
+  std::vector<uint32_t> prealloc_;
+  size_t prealloc_next_;
+  uint32_t alloc_goal_;
+  bool eager_zero_;
+  bool extents_;
+  bool dir_index_;
+  uint32_t ra_max_;
+  mutable ReadaheadStats ra_stats_;
+  // directory -> name -> inode ID, 0 for a name known to be absent
+  std::unordered_map<uint32_t, std::unordered_map<std::string, uint32_t>>
+      dcache_;
+  size_t dcache_size_;
+  bool dcache_on_;
+  DentryStats dcache_stats_;
+  void dcache_set(uint32_t dir, const std::string& name, uint32_t iid);
+  // reserves about count blocks in contiguous runs starting near goal
+  void reserveBlocks(uint32_t goal, size_t count);
+  // zero: the caller does not overwrite the whole block. 0 when the disk is
+  // full
+  uint32_t allocBlock(bool zero);
+  // whether count blocks from logical block lbid on can be mapped, with the
+  // indirect blocks or extent tree splits they may bring
+  bool can_alloc(const inode& in, size_t lbid, size_t count = 1) const;
+  // frees the reserved blocks that were not handed out
+  void releaseBlocks();
+  // iid 0: in is a copy not tied to the cache, bmap walks every time
+  size_t read_inode_data_helper(const inode& in, uint32_t iid, void* dst,
+                                size_t offset, size_t size) const;
+  // allocates logical block lbid of a write ending at logical block last,
+  // reserving blocks for the rest of the write on the first hole
+  uint32_t alloc_data(inode& in, uint32_t iid, size_t lbid, size_t last,
+                      bool zero);
+  // whole logical blocks [first, end) to or from a buffer, one device request
+  // per physically contiguous run, around the block cache
+  void read_direct(const inode& in, uint32_t iid, char* dst, size_t first,
+                   size_t end) const;
+  // write_direct returns the blocks written, write_inode_data_helper the
+  // bytes; both stop short when the disk is full
+  size_t write_direct(inode& in, uint32_t iid, const char* src, size_t first,
+                      size_t end, size_t last);
+  // last is the final logical block of the whole write, to size reservations
+  size_t write_inode_data_helper(inode& in, uint32_t iid, const void* src,
+                                 size_t offset, size_t size, size_t last);
+  // physical block holding logical block lbid, 0 if not mapped. With
+  // missing, an indirect block that is not cached stops the walk: it is
+  // stored there and 0 returned.
+  uint32_t bmap(const inode& in, uint32_t iid, size_t lbid,
+                uint32_t* missing = nullptr) const;
+  // like bmap, but allocates the data block and any missing indirect blocks,
+  // counting them in i_blocks_; indirect blocks are zeroed, the data block
+  // only with zero. 0, with nothing changed, when they do not fit on the disk
+  uint32_t bmap_alloc(inode& in, uint32_t iid, size_t lbid, bool zero);
+  // bmap and bmap_alloc of an extent-mapped inode. ext_insert records
+  // lbid -> pbid, growing the extent before it where it can.
+  uint32_t ext_bmap(const inode& in, uint32_t iid, size_t lbid,
+                    uint32_t* missing) const;
+  void ext_insert(inode& in, uint32_t lbid, uint32_t pbid);
+  // a new, empty node block of the tree, counted in i_blocks_
+  uint32_t ext_new_node(inode& in, FSBlock* block);
+  // frees the blocks mapped from logical block first on, below the node at
+  // h, adding their number to *freed; true if the node is left empty
+  bool ext_truncate(Extent_Header* h, uint32_t first, uint32_t* freed);
+  // whole blocks of a directory; dir_append adds one at the end and returns
+  // its logical block
+  BlockPool::Handle dir_read(const inode& in, uint32_t iid,
+                             uint32_t lbid) const;
+  void dir_write(uint32_t iid, uint32_t lbid, const char* buf);
+  uint32_t dir_append(uint32_t iid, const char* buf);
+  // the cached directory with its free space scanned
+  CachedInode& dir_space(uint32_t iid);
+  // re-adds the entries of an indexed directory to an emptied one
+  uint32_t rebuild_dir(uint32_t iid);
+  // name in a directory, linear or indexed; iid 0 as for bmap
+  bool dir_find(const inode& in, uint32_t iid, const std::string& name,
+                uint32_t* ret);
+  // An index node on the way from the root to a leaf: its logical block,
+  // its contents and the entry followed.
+  struct DxFrame {
+    uint32_t lbid_;
+    BlockPool::Handle node_;
+    uint32_t at_;
+  };
+  // root and index levels below it
+  static constexpr int DX_MAX_DEPTH = 2;
+  // fills path with the index nodes down to the leaf that hash belongs in,
+  // returns how many
+  int dx_probe(const inode& in, uint32_t iid, uint32_t hash,
+               DxFrame* path) const;
+  // the leaf block holding name and the entry's offset in it, and the
+  // offset of the entry before it in the block, SIZE_MAX for the first
+  bool dx_locate(const inode& in, uint32_t iid, const std::string& name,
+                 BlockPool::Handle* leaf, uint32_t* lbid, size_t* off,
+                 size_t* prev) const;
+  int dx_add(uint32_t dir, uint32_t src, const std::string& name,
+             uint8_t type);
+  bool dx_del(uint32_t dir, const std::string& name);
+  // adds (hash, block) after the entry followed in the bottom node of path,
+  // splitting nodes or deepening the tree as needed; -ENOSPC when both
+  // levels are full
+  int dx_insert_entry(uint32_t dir, DxFrame* path, int depth, uint32_t hash,
+                      uint32_t block);
+  // turns a directory whose entries fill its first block into an indexed
+  // one with a single leaf
+  void dx_convert(uint32_t dir);
+  // allocation goal for logical block lbid: right after the block before it,
+  // or the start of the inode's group
+  uint32_t data_goal(const inode& in, uint32_t iid, size_t lbid) const;
+  // updates ra for a read of [offset, offset + size) and prefetches ahead of
+  // it
+  void readahead(const inode& in, uint32_t iid, Readahead* ra, size_t offset,
+                 size_t size) const;
+  // hint and batch-load the blocks a multi-block access is about to touch
+  void prepare_range(const inode& in, uint32_t iid, size_t offset,
+                     size_t size) const;
 };
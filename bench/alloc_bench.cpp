@@ -0,0 +1,75 @@
+// Block allocation rate: allocates every free block of a freshly formatted
+// RamDisk with BlockManager::getIdleBlock, frees every other one with
+// tagBlock and allocates those again, so the second pass has to find free
+// bits scattered across the whole device. Last, runs of 1 to 64 blocks are
+// freed all over the device and taken back with getIdleRun in requests of 32
+// blocks from random goals; the average run returned shows how well the
+// requests were fitted.
+//
+//   ./build/alloc_bench [image MiB] [log block size]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "BlockManager.h"
+#include "img.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double perSec(size_t n, Clock::time_point start) {
+  std::chrono::duration<double> secs = Clock::now() - start;
+  return n / secs.count();
+}
+
+int main(int argc, char* argv[]) {
+  int image_mib = argc > 1 ? atoi(argv[1]) : 256;
+  uint32_t lbs = argc > 2 ? atoi(argv[2]) : 0;
+
+  auto bd = makeDisk("ram", image_mib * 1024);
+  if (!bd->initialize(true)) return 1;
+  ImgMaker::mkfs(bd, lbs);
+  auto sbm = std::make_shared<SuperBlockManager>(bd);
+  auto bm = std::make_shared<BlockManager>(bd, sbm);
+  const auto& sb = sbm->readSuperBlock();
+
+  uint32_t free = 0;
+  for (uint32_t b = sb.s_first_data_block_; b < sb.s_blocks_count_; b++)
+    free += !bm->state(b);
+  std::vector<uint32_t> bids;
+  auto start = Clock::now();
+  for (uint32_t i = 0; i < free; i++) bids.push_back(bm->getIdleBlock());
+  double fill = perSec(bids.size(), start);
+
+  for (size_t i = 0; i < bids.size(); i += 2) bm->tagBlock(bids[i], 0);
+  start = Clock::now();
+  for (size_t i = 0; i < bids.size(); i += 2) bids[i] = bm->getIdleBlock();
+  double refill = perSec(bids.size() / 2, start);
+
+  // every 256 blocks, a free run of 1 to 64 blocks
+  for (size_t i = 0; i + 64 <= bids.size(); i += 256)
+    for (size_t j = 0; j <= i / 256 % 64; j++) bm->tagBlock(bids[i + j], 0);
+  auto frag = bm->freeSpaceStats();
+  std::mt19937 rng(1);
+  size_t calls = 0, blocks = 0;
+  start = Clock::now();
+  while (bm->freeBlocks()) {
+    uint32_t len;
+    uint32_t goal = sb.s_first_data_block_ +
+                    rng() % (sb.s_blocks_count_ - sb.s_first_data_block_);
+    bm->getIdleRun(goal, 32, &len);
+    calls++;
+    blocks += len;
+  }
+  double runs = perSec(calls, start);
+
+  printf("%d MiB image, %u byte blocks, %zu blocks\n", image_mib, 1024u << lbs,
+         bids.size());
+  printf("fill   %12.0f allocs/s\n", fill);
+  printf("refill %12.0f allocs/s\n", refill);
+  printf("runs   %12.0f allocs/s, %.1f blocks per run; %u free runs, "
+         "longest %u\n",
+         runs, double(blocks) / calls, frag.runs_, frag.longest_);
+  return 0;
+}
@@ -0,0 +1,120 @@
+// Large directories. Names are created in one directory through MyFS, then
+// looked up again in random order, with the dentry cache off so that every
+// lookup searches the directory. Each row reports the creations and lookups
+// per second, the block cache reads per lookup and the directory's size in
+// blocks, for a linear directory and a hashed one (EXT2_INDEX_FL). The
+// linear directory gets fewer names: filling it takes quadratic time.
+// Last, temporary files come and go in a directory holding a few hundred of
+// them, the way lock and spool files do; the directory should stay as small
+// as its live entries need.
+//
+//   ./build/dir_bench [disk spec] [names] [linear names] [log block size]
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "floppy.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double perSec(size_t n, Clock::time_point start) {
+  std::chrono::duration<double> secs = Clock::now() - start;
+  return n / secs.count();
+}
+
+static void run(const std::string& spec, int names, uint32_t lbs,
+                bool index) {
+  // mkfs makes an inode per four blocks
+  auto fs =
+      MyFS::mytest(makeDisk(spec, (names + 4096) * (4 << 2 * lbs)), lbs);
+  fs->im_->useDirIndex(index);
+  fs->im_->dentryCache(false);
+  inode dir, file;
+  memset(&dir, 0, sizeof(inode));
+  dir.i_mode_ = EXT2_S_IFDIR | 0755;
+  dir.i_links_count_ = 2;
+  memset(&file, 0, sizeof(inode));
+  file.i_mode_ = EXT2_S_IFREG | 0644;
+  file.i_links_count_ = 1;
+  fs->mkdir("/spool", dir);
+
+  std::vector<std::string> paths;
+  for (int i = 0; i < names; i++)
+    paths.push_back("/spool/msg." + std::to_string(i * 7919L % 1000003));
+  auto start = Clock::now();
+  for (const auto& p : paths)
+    if (fs->create(p, file)) {
+      printf("creating %s failed\n", p.c_str());
+      exit(1);
+    }
+  double creates = perSec(names, start);
+
+  std::shuffle(paths.begin(), paths.end(), std::mt19937(1));
+  auto before = fs->bm_->cacheStats();
+  start = Clock::now();
+  for (const auto& p : paths)
+    if (!fs->readdir(p)) {
+      printf("%s not found\n", p.c_str());
+      exit(1);
+    }
+  double lookups = perSec(names, start);
+  auto& after = fs->bm_->cacheStats();
+
+  inode in;
+  fs->readdir("/spool", &in);
+  printf("%-7s %8d %12.0f %12.0f %10.2f %8u\n", index ? "hashed" : "linear",
+         names, creates, lookups,
+         double(after.hits_ + after.misses_ - before.hits_ - before.misses_) /
+             names,
+         in.i_size_ / (1024 << lbs));
+}
+
+static void churn(const std::string& spec, int rounds, uint32_t lbs,
+                  bool index) {
+  auto fs = MyFS::mytest(makeDisk(spec, 65536), lbs);
+  fs->im_->useDirIndex(index);
+  inode dir, file;
+  memset(&dir, 0, sizeof(inode));
+  dir.i_mode_ = EXT2_S_IFDIR | 0755;
+  dir.i_links_count_ = 2;
+  memset(&file, 0, sizeof(inode));
+  file.i_mode_ = EXT2_S_IFREG | 0644;
+  file.i_links_count_ = 1;
+  fs->mkdir("/tmp", dir);
+
+  constexpr int LIVE = 300;
+  auto path = [](int i) { return "/tmp/lock." + std::to_string(i); };
+  for (int i = 0; i < LIVE; i++) fs->create(path(i), file);
+  auto start = Clock::now();
+  for (int i = LIVE; i < LIVE + rounds; i++) {
+    fs->create(path(i), file);
+    fs->unlink(path(i - LIVE));
+  }
+  double ops = perSec(2 * rounds, start);
+  inode in;
+  fs->readdir("/tmp", &in);
+  printf("%-7s %8d %12.0f %12s %10s %8u\n", index ? "churn h" : "churn l",
+         LIVE, ops, "", "", in.i_size_ / (1024 << lbs));
+}
+
+int main(int argc, char* argv[]) {
+  std::string spec = argc > 1 ? argv[1] : "ram";
+  int names = argc > 2 ? atoi(argv[2]) : 100000;
+  int linear = argc > 3 ? atoi(argv[3]) : 5000;
+  uint32_t lbs = argc > 4 ? atoi(argv[4]) : 0;
+
+  printf("%s, %u byte blocks\n", spec.c_str(), 1024u << lbs);
+  printf("%-7s %8s %12s %12s %10s %8s\n", "dir", "names", "creates/s",
+         "lookups/s", "blk reads", "blocks");
+  run(spec, linear, lbs, false);
+  run(spec, linear, lbs, true);
+  run(spec, names, lbs, true);
+  churn(spec, 100000, lbs, false);
+  churn(spec, 100000, lbs, true);
+  return 0;
+}
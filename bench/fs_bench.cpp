@@ -0,0 +1,74 @@
+// Sequential file throughput for each filesystem block size. A fresh RamDisk
+// (or image file) is formatted with 1, 2 and 4 KiB blocks, then one file is
+// written and read back in fixed size chunks through InodeManager, the same
+// calls MyFS::write and MyFS::read make after the path lookup. Each size is
+// run with the file mapped by indirect blocks and by an extent tree; "map
+// blocks" counts the blocks holding the mapping.
+//
+//   ./build/fs_bench [disk spec] [image MiB] [file MiB] [chunk KiB]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "InodeManager.h"
+#include "img.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double mibPerSec(size_t bytes, Clock::time_point start) {
+  std::chrono::duration<double> secs = Clock::now() - start;
+  return bytes / secs.count() / (1 << 20);
+}
+
+int main(int argc, char* argv[]) {
+  std::string spec = argc > 1 ? argv[1] : "ram";
+  int image_mib = argc > 2 ? atoi(argv[2]) : 512;
+  size_t file_mib = argc > 3 ? atoi(argv[3]) : 256;
+  size_t chunk = (argc > 4 ? atoi(argv[4]) : 64) * 1024;
+  std::vector<char> buf(chunk, 'x');
+  size_t file_size = file_mib << 20;
+
+  printf("%s, %d MiB image, %zu MiB file, %zu KiB chunks\n", spec.c_str(),
+         image_mib, file_mib, chunk / 1024);
+  printf("%-6s %-8s %12s %12s %10s\n", "block", "map", "write MiB/s",
+         "read MiB/s", "map blocks");
+  for (int run = 0; run < 6; run++) {
+    uint32_t lbs = run / 2;
+    bool extents = run % 2;
+    auto bd = makeDisk(spec, image_mib * 1024);
+    if (!bd->initialize(true)) return 1;
+    ImgMaker::mkfs(bd, lbs);
+    auto sbm = std::make_shared<SuperBlockManager>(bd);
+    auto bm = std::make_shared<BlockManager>(bd, sbm);
+    auto im = std::make_shared<InodeManager>(sbm, bm);
+    im->useExtents(extents);
+
+    inode in;
+    memset(&in, 0, sizeof(inode));
+    in.i_mode_ = EXT2_S_IFREG | 0644;
+    in.i_links_count_ = 1;
+    auto iid = im->new_inode(in);
+
+    auto start = Clock::now();
+    for (size_t off = 0; off < file_size; off += chunk) {
+      im->resize(iid, off + chunk);
+      im->write_inode_data(iid, buf.data(), off, chunk);
+    }
+    im->flush();
+    double w = mibPerSec(file_size, start);
+
+    start = Clock::now();
+    for (size_t off = 0; off < file_size; off += chunk)
+      im->read_inode_data(iid, buf.data(), off, chunk);
+    double r = mibPerSec(file_size, start);
+
+    auto blocks = im->read_inode(iid).i_blocks_ / (2 << lbs);
+    printf("%-6u %-8s %12.1f %12.1f %10zu\n", 1024u << lbs,
+           extents ? "extents" : "indirect", w, r,
+           blocks - file_size / (1024 << lbs));
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+// Compares the synchronous FileDisk path with the io_uring backend on a local
+// image file: batches of scattered single-block reads, then batches of
+// scattered writes, each batch handed to MyDisk::submit() and reaped with
+// MyDisk::wait().
+//
+//   ./build/io_bench [image] [batch] [rounds]
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "device.h"
+
+static double run(MyDisk& disk, bool write, int batch, int rounds) {
+  std::vector<DeviceBlock> bufs(batch);
+  std::vector<struct iovec> iov(batch);
+  std::vector<MyDisk::Request> reqs(batch);
+  std::mt19937 rng(42);
+  for (int i = 0; i < batch; i++) iov[i] = {bufs[i].s_, BLOCK_SIZE};
+
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < batch; i++)
+      reqs[i] = MyDisk::Request{write, int(rng() % BLOCK_NUM), &iov[i], 1};
+    disk.submit(reqs.data(), batch);
+    disk.wait();
+  }
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  return double(batch) * rounds / secs.count();
+}
+
+int main(int argc, char* argv[]) {
+  std::string image = argc > 1 ? argv[1] : "/tmp/io_bench.img";
+  int batch = argc > 2 ? atoi(argv[2]) : 64;
+  int rounds = argc > 3 ? atoi(argv[3]) : 2000;
+
+  int fd = open(image.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || ftruncate(fd, off_t(BLOCK_NUM) * BLOCK_SIZE) != 0) {
+    perror(image.c_str());
+    return 1;
+  }
+  close(fd);
+
+  FileDisk sync(image);
+  UringDisk uring(image);
+  if (!sync.initialize() || !uring.initialize()) return 1;
+  if (!uring.async()) printf("io_uring unavailable, measuring the fallback\n");
+
+  printf("%d-block batches, %d rounds\n", batch, rounds);
+  printf("%-8s %14s %14s\n", "", "read blk/s", "write blk/s");
+  double sr = run(sync, false, batch, rounds);
+  double sw = run(sync, true, batch, rounds);
+  printf("%-8s %14.0f %14.0f\n", "sync", sr, sw);
+  double ur = run(uring, false, batch, rounds);
+  double uw = run(uring, true, batch, rounds);
+  printf("%-8s %14.0f %14.0f\n", "io_uring", ur, uw);
+  return 0;
+}
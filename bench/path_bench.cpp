@@ -0,0 +1,115 @@
+// Path resolution. A tree of nested directories, each holding a few dozen
+// files, is built through MyFS; then every file path, and a missing name
+// next to each, is resolved over and over with MyFS::readdir, the way FUSE
+// resolves the path of each getattr or open. Each row reports the lookups
+// per second, the block cache reads per lookup and the dentry cache counters,
+// without and with the dentry cache. A last row creates and removes files
+// in the deepest directory, each operation resolving the path down to it.
+//
+//   ./build/path_bench [disk spec] [depth] [files per directory] [passes]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "floppy.h"
+
+using Clock = std::chrono::steady_clock;
+
+static void run(MyFS& fs, const std::vector<std::string>& paths, int passes,
+                bool cache) {
+  fs.im_->dentryCache(cache);
+  auto before = fs.bm_->cacheStats();
+  auto dbefore = fs.im_->dentryStats();
+  size_t lookups = 0;
+  auto start = Clock::now();
+  for (int pass = 0; pass < passes; pass++) {
+    for (const auto& p : paths) {
+      if (!fs.readdir(p)) {
+        printf("%s not found\n", p.c_str());
+        exit(1);
+      }
+      if (fs.readdir(p + ".missing")) {
+        printf("%s.missing found\n", p.c_str());
+        exit(1);
+      }
+      lookups += 2;
+    }
+  }
+  std::chrono::duration<double> secs = Clock::now() - start;
+  auto& after = fs.bm_->cacheStats();
+  auto& dafter = fs.im_->dentryStats();
+  printf("%-6s %12.0f %10.2f %10lu %10lu %10lu\n", cache ? "on" : "off",
+         lookups / secs.count(),
+         double(after.hits_ + after.misses_ - before.hits_ - before.misses_) /
+             lookups,
+         (unsigned long)(dafter.hits_ - dbefore.hits_),
+         (unsigned long)(dafter.negative_hits_ - dbefore.negative_hits_),
+         (unsigned long)(dafter.misses_ - dbefore.misses_));
+}
+
+static void churn(MyFS& fs, const std::string& dir, int rounds) {
+  inode file;
+  memset(&file, 0, sizeof(inode));
+  file.i_mode_ = EXT2_S_IFREG | 0644;
+  file.i_links_count_ = 1;
+  auto before = fs.bm_->cacheStats();
+  auto dbefore = fs.im_->dentryStats();
+  auto start = Clock::now();
+  for (int i = 0; i < rounds; i++) {
+    auto p = dir + "/tmp" + std::to_string(i % 64);
+    if (fs.create(p, file) || fs.unlink(p)) {
+      printf("churning %s failed\n", p.c_str());
+      exit(1);
+    }
+  }
+  std::chrono::duration<double> secs = Clock::now() - start;
+  auto& after = fs.bm_->cacheStats();
+  auto& dafter = fs.im_->dentryStats();
+  printf("%-6s %12.0f %10.2f %10lu %10lu %10lu\n", "churn",
+         2 * rounds / secs.count(),
+         double(after.hits_ + after.misses_ - before.hits_ - before.misses_) /
+             (2 * rounds),
+         (unsigned long)(dafter.hits_ - dbefore.hits_),
+         (unsigned long)(dafter.negative_hits_ - dbefore.negative_hits_),
+         (unsigned long)(dafter.misses_ - dbefore.misses_));
+}
+
+int main(int argc, char* argv[]) {
+  std::string spec = argc > 1 ? argv[1] : "ram";
+  int depth = argc > 2 ? atoi(argv[2]) : 12;
+  int files = argc > 3 ? atoi(argv[3]) : 32;
+  int passes = argc > 4 ? atoi(argv[4]) : 20;
+
+  auto fs = MyFS::mytest(spec, 2);
+  inode dir, file;
+  memset(&dir, 0, sizeof(inode));
+  dir.i_mode_ = EXT2_S_IFDIR | 0755;
+  dir.i_links_count_ = 2;
+  memset(&file, 0, sizeof(inode));
+  file.i_mode_ = EXT2_S_IFREG | 0644;
+  file.i_links_count_ = 1;
+
+  std::vector<std::string> paths;
+  std::string cur;
+  for (int d = 0; d < depth; d++) {
+    for (int f = 0; f < files; f++) {
+      auto p = cur + "/file" + std::to_string(f);
+      fs->create(p, file);
+      paths.push_back(p);
+    }
+    cur += "/dir" + std::to_string(d);
+    fs->mkdir(cur, dir);
+  }
+
+  printf("%s, depth %d, %d files per directory, %zu paths\n", spec.c_str(),
+         depth, files, paths.size());
+  printf("%-6s %12s %10s %10s %10s %10s\n", "cache", "lookups/s",
+         "blk reads", "hits", "neg hits", "misses");
+  run(*fs, paths, passes, false);
+  run(*fs, paths, passes, true);
+  churn(*fs, cur, 20000);
+  return 0;
+}
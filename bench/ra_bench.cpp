@@ -0,0 +1,107 @@
+// Sequential readahead. A file is written once, then read back through
+// InodeManager from a cold block cache in small chunks, the way a FUSE read
+// loop sees it: sequentially without and with readahead, and at random
+// offsets with readahead on, which should collapse the window. The image's
+// page cache is dropped before each pass where the kernel allows it. Each
+// row reports the throughput, the blocks requested ahead, and how many of
+// the blocks read ahead were used or evicted unused.
+//
+//   ./build/ra_bench [disk spec] [file MiB] [chunk KiB] [window KiB]
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "InodeManager.h"
+#include "img.h"
+
+using Clock = std::chrono::steady_clock;
+
+// the image path of a file-backed spec, empty for "ram"
+static std::string imagePath(const std::string& spec) {
+  if (spec.compare(0, 3, "ram") == 0) return "";
+  auto pos = spec.find(':');
+  return pos == std::string::npos ? spec : spec.substr(pos + 1);
+}
+
+static void dropPageCache(const std::string& path) {
+  if (path.empty()) return;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void run(const std::shared_ptr<MyDisk>& bd, const std::string& spec,
+                uint32_t iid, size_t file_size, size_t chunk, uint32_t window,
+                bool random, const char* name) {
+  dropPageCache(imagePath(spec));
+  // a fresh mount: nothing cached
+  auto sbm = std::make_shared<SuperBlockManager>(bd);
+  auto bm = std::make_shared<BlockManager>(bd, sbm);
+  auto im = std::make_shared<InodeManager>(sbm, bm);
+  im->readaheadLimit(window);
+  std::vector<char> buf(chunk);
+  std::mt19937 rng(1);
+  InodeManager::Readahead ra{};
+
+  auto start = Clock::now();
+  size_t chunks = file_size / chunk;
+  for (size_t i = 0; i < chunks; i++) {
+    size_t off = (random ? rng() % chunks : i) * chunk;
+    im->read_inode_data(iid, buf.data(), off, chunk, &ra);
+    if (!random && buf[0] != 'x') {
+      printf("bad data at %zu\n", off);
+      exit(1);
+    }
+  }
+  std::chrono::duration<double> secs = Clock::now() - start;
+  auto& cs = bm->cacheStats();
+  auto& rs = im->readaheadStats();
+  printf("%-10s %10.1f %10lu %10lu %10lu %8u\n", name,
+         file_size / secs.count() / (1 << 20), (unsigned long)rs.issued_,
+         (unsigned long)cs.prefetch_hits_, (unsigned long)cs.prefetch_wasted_,
+         rs.peak_window_ / 1024);
+}
+
+int main(int argc, char* argv[]) {
+  std::string spec = argc > 1 ? argv[1] : "/tmp/ra_bench.img";
+  size_t file_size = size_t(argc > 2 ? atoi(argv[2]) : 64) << 20;
+  size_t chunk = size_t(argc > 3 ? atoi(argv[3]) : 4) << 10;
+  uint32_t window = (argc > 4 ? atoi(argv[4]) : 128) << 10;
+
+  auto bd = makeDisk(spec, file_size / 1024 + 16384);
+  if (!bd->initialize(true)) return 1;
+  ImgMaker::mkfs(bd, 2);
+  uint32_t iid;
+  {
+    auto sbm = std::make_shared<SuperBlockManager>(bd);
+    auto bm = std::make_shared<BlockManager>(bd, sbm);
+    auto im = std::make_shared<InodeManager>(sbm, bm);
+    inode in;
+    memset(&in, 0, sizeof(inode));
+    in.i_mode_ = EXT2_S_IFREG | 0644;
+    in.i_links_count_ = 1;
+    iid = im->new_inode(in);
+    std::vector<char> buf(1 << 20, 'x');
+    im->resize(iid, file_size);
+    for (size_t off = 0; off < file_size; off += buf.size())
+      im->write_inode_data(iid, buf.data(), off, buf.size());
+    im->flush();
+  }
+
+  printf("%s, %zu MiB file, %zu KiB reads, %u KiB window\n", spec.c_str(),
+         file_size >> 20, chunk >> 10, window >> 10);
+  printf("%-10s %10s %10s %10s %10s %8s\n", "pattern", "MiB/s", "issued",
+         "used", "wasted", "peak KiB");
+  run(bd, spec, iid, file_size, chunk, 0, false, "seq, off");
+  run(bd, spec, iid, file_size, chunk, window, false, "seq, on");
+  run(bd, spec, iid, file_size, chunk, window, true, "random, on");
+  return 0;
+}
@@ -0,0 +1,75 @@
+// Write amplification of block allocation. A file is written through
+// InodeManager once with whole-block chunks and once with small unaligned
+// appends, with new data blocks zeroed lazily (only when the write leaves
+// part of them alone) and eagerly (always, the old behaviour). For each run
+// it reports the blocks written into the block cache and the blocks written
+// to the device (written back, or written directly by large writes), both
+// per block of file data. Backends that lend their pages to the cache
+// ("ram", "mmap:") take every cache write as a device write and never write
+// back.
+//
+//   ./build/zero_bench [disk spec] [file MiB] [log block size]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "InodeManager.h"
+#include "img.h"
+
+using Clock = std::chrono::steady_clock;
+
+static void run(const std::string& spec, size_t file_size, uint32_t lbs,
+                size_t chunk, bool eager) {
+  // room for the file, its indirect blocks and the metadata
+  auto bd = makeDisk(spec, file_size / 1024 * 2 + 8192);
+  if (!bd->initialize(true)) exit(1);
+  ImgMaker::mkfs(bd, lbs);
+  auto sbm = std::make_shared<SuperBlockManager>(bd);
+  auto bm = std::make_shared<BlockManager>(bd, sbm);
+  auto im = std::make_shared<InodeManager>(sbm, bm);
+  im->eagerZero(eager);
+
+  inode in;
+  memset(&in, 0, sizeof(inode));
+  in.i_mode_ = EXT2_S_IFREG | 0644;
+  in.i_links_count_ = 1;
+  auto iid = im->new_inode(in);
+  std::vector<char> buf(chunk, 'x');
+
+  auto before = bm->cacheStats();
+  auto start = Clock::now();
+  for (size_t off = 0; off < file_size; off += chunk) {
+    im->resize(iid, off + chunk);
+    im->write_inode_data(iid, buf.data(), off, chunk);
+  }
+  im->flush();
+  std::chrono::duration<double> secs = Clock::now() - start;
+  auto& after = bm->cacheStats();
+
+  double blocks = double(file_size) / (1024 << lbs);
+  printf("%-8zu %-6s %10.1f %10.2f %10.2f\n", chunk, eager ? "eager" : "lazy",
+         file_size / secs.count() / (1 << 20),
+         (after.writes_ - before.writes_) / blocks,
+         (after.writebacks_ + after.direct_writes_ - before.writebacks_ -
+          before.direct_writes_) /
+             blocks);
+}
+
+int main(int argc, char* argv[]) {
+  std::string spec = argc > 1 ? argv[1] : "ram";
+  size_t file_size = size_t(argc > 2 ? atoi(argv[2]) : 64) << 20;
+  uint32_t lbs = argc > 3 ? atoi(argv[3]) : 2;
+
+  printf("%s, %zu MiB file, %u byte blocks\n", spec.c_str(), file_size >> 20,
+         1024u << lbs);
+  printf("%-8s %-6s %10s %10s %10s\n", "chunk", "zero", "MiB/s", "cache wr",
+         "device wr");
+  for (size_t chunk : {size_t(64) << 10, size_t(1000)}) {
+    run(spec, file_size, lbs, chunk, true);
+    run(spec, file_size, lbs, chunk, false);
+  }
+  return 0;
+}
@@ -1,47 +1,415 @@
 #include "device.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
 
 #include "cassert"
 #include "cstring"
 
-MyDisk::MyDisk(const std::string& filename) : filename_(filename) {}
+// Dropping pages from a mapping only pays off for large ranges: smaller
+// ones are cheaper to memset than to fault back in.
+constexpr size_t MIN_PAGE_DROP = 1 << 20;
+
+bool MyDisk::bwrite(const DeviceBlock* b, int blockNo) {
+  assert(blockNo >= 0 && blockNo < blocks_);
+  struct iovec iov = {const_cast<char*>(b->s_), BLOCK_SIZE};
+  return bwritev(&iov, 1, blockNo);
+}
+std::unique_ptr<DeviceBlock> MyDisk::bread(int blockNo) {
+  auto b = std::make_unique<DeviceBlock>();
+  bread(blockNo, b.get());
+  return b;
+}
+bool MyDisk::bread(int blockNo, DeviceBlock* b) {
+  assert(blockNo >= 0 && blockNo < blocks_);
+  struct iovec iov = {b->s_, BLOCK_SIZE};
+  return breadv(&iov, 1, blockNo);
+}
+
+bool MyDisk::breadv(const int* blockNos, DeviceBlock* const* bufs, int n) {
+  struct iovec iov[IOV_MAX];
+  for (int i = 0; i < n;) {
+    int run = 0;
+    do {
+      iov[run] = {bufs[i + run]->s_, BLOCK_SIZE};
+      run++;
+    } while (i + run < n && run < IOV_MAX &&
+             blockNos[i + run] == blockNos[i] + run);
+    if (!breadv(iov, run, blockNos[i])) return false;
+    i += run;
+  }
+  return true;
+}
+
+bool MyDisk::bwritev(const int* blockNos, const DeviceBlock* const* bufs,
+                     int n) {
+  struct iovec iov[IOV_MAX];
+  for (int i = 0; i < n;) {
+    int run = 0;
+    do {
+      iov[run] = {const_cast<char*>(bufs[i + run]->s_), BLOCK_SIZE};
+      run++;
+    } while (i + run < n && run < IOV_MAX &&
+             blockNos[i + run] == blockNos[i] + run);
+    if (!bwritev(iov, run, blockNos[i])) return false;
+    i += run;
+  }
+  return true;
+}
+
+bool MyDisk::submit(const Request* reqs, int n) {
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    auto& r = reqs[i];
+    ok &= r.write_ ? bwritev(r.iov_, r.iovcnt_, r.blockNo_)
+                   : breadv(r.iov_, r.iovcnt_, r.blockNo_);
+  }
+  return ok;
+}
+
+bool MyDisk::discard(int blockNo, int count) {
+  // 64 KiB of zeros, repeated through the iovec array
+  static const DeviceBlock zeros[64] = {};
+  struct iovec iov[IOV_MAX];
+  for (int i = 0; i < IOV_MAX; i++)
+    iov[i] = {const_cast<DeviceBlock*>(zeros), sizeof(zeros)};
+  const int per_iov = sizeof(zeros) / BLOCK_SIZE;
+  while (count >= per_iov) {
+    int n = std::min(count / per_iov, IOV_MAX);
+    if (!bwritev(iov, n, blockNo)) return false;
+    blockNo += n * per_iov;
+    count -= n * per_iov;
+  }
+  for (; count > 0; count--, blockNo++)
+    if (!bwrite(zeros, blockNo)) return false;
+  return true;
+}
+
+FileDisk::FileDisk(const std::string& filename, int blocks)
+    : MyDisk(blocks), fd_(-1), filename_(filename) {}
 
-MyDisk::~MyDisk() {
-  if (file_.is_open()) {
-    file_.close();
+FileDisk::~FileDisk() {
+  if (fd_ >= 0) {
+    close(fd_);
   }
 }
 
-bool MyDisk::initialize(bool format) {
-  if (!file_.is_open())
-    file_.open(filename_, std::ios::in | std::ios::out | std::ios::binary);
-  if (!file_.is_open()) {
+bool FileDisk::initialize(bool format) {
+  if (fd_ < 0)
+    fd_ = open(filename_.c_str(), O_RDWR | (format ? O_CREAT : 0), 0644);
+  if (fd_ < 0) {
     std::cerr << "Unable to open file." << std::endl;
     return false;
   }
+  if (!blocks_) {
+    struct stat st;
+    if (!format && fstat(fd_, &st) == 0) blocks_ = st.st_size / BLOCK_SIZE;
+    if (!blocks_) blocks_ = BLOCK_NUM;
+  }
   if (format) {
-    DeviceBlock emptyBlock;
-    memset(emptyBlock.s_, 0, BLOCK_SIZE);
-    for (int i = 0; i < BLOCK_NUM; i++) {
-      bwrite(&emptyBlock, i);
+    // recreate the image as one big hole; not possible on a block device
+    off_t size = static_cast<off_t>(blocks_) * BLOCK_SIZE;
+    if (ftruncate(fd_, 0) != 0 || ftruncate(fd_, size) != 0)
+      return discard(0, blocks_);
+  }
+  return true;
+}
+
+bool FileDisk::breadv(const struct iovec* iov, int iovcnt, int blockNo) {
+  return transfer(false, iov, iovcnt, blockNo);
+}
+
+bool FileDisk::bwritev(const struct iovec* iov, int iovcnt, int blockNo) {
+  return transfer(true, iov, iovcnt, blockNo);
+}
+
+bool FileDisk::flush() { return fdatasync(fd_) == 0; }
+
+bool FileDisk::discard(int blockNo, int count) {
+  if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                static_cast<off_t>(blockNo) * BLOCK_SIZE,
+                static_cast<off_t>(count) * BLOCK_SIZE) == 0)
+    return true;
+  return MyDisk::discard(blockNo, count);
+}
+
+void FileDisk::advise(int blockNo, int count, Advice advice) {
+  int a = advice == Advice::Sequential ? POSIX_FADV_SEQUENTIAL
+          : advice == Advice::WillNeed ? POSIX_FADV_WILLNEED
+                                       : POSIX_FADV_NORMAL;
+  posix_fadvise(fd_, static_cast<off_t>(blockNo) * BLOCK_SIZE,
+                static_cast<off_t>(count) * BLOCK_SIZE, a);
+}
+
+bool FileDisk::transfer(bool write, const struct iovec* iov, int iovcnt,
+                         int blockNo) {
+  assert(fd_ >= 0);
+  off_t off = static_cast<off_t>(blockNo) * BLOCK_SIZE;
+  int i = 0;
+  while (i < iovcnt) {
+    assert(iov[i].iov_len % BLOCK_SIZE == 0);
+    assert(off / BLOCK_SIZE < blocks_);
+    int cnt = std::min(iovcnt - i, IOV_MAX);
+    ssize_t n = write ? pwritev(fd_, iov + i, cnt, off)
+                      : preadv(fd_, iov + i, cnt, off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (n == 0) {
+      // reading past the end of the image file
+      if (write) return false;
+      for (; i < iovcnt; i++) memset(iov[i].iov_base, 0, iov[i].iov_len);
+      return true;
+    }
+    off += n;
+    while (i < iovcnt && static_cast<size_t>(n) >= iov[i].iov_len) {
+      n -= iov[i].iov_len;
+      i++;
     }
+    if (n == 0) continue;
+    // short transfer inside iov[i], finish it with plain pread/pwrite
+    char* base = static_cast<char*>(iov[i].iov_base) + n;
+    size_t left = iov[i].iov_len - n;
+    while (left) {
+      ssize_t m = write ? pwrite(fd_, base, left, off)
+                        : pread(fd_, base, left, off);
+      if (m < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      if (m == 0) {
+        if (write) return false;
+        memset(base, 0, left);
+        m = left;
+      }
+      base += m;
+      left -= m;
+      off += m;
+    }
+    i++;
   }
   return true;
 }
 
-bool MyDisk::bwrite(const DeviceBlock* b, int blockNo) {
-  assert(blockNo >= 0 && blockNo < BLOCK_NUM);
-  assert(file_.is_open());
-  file_.seekp(blockNo * BLOCK_SIZE);
-  file_.write(b->s_, BLOCK_SIZE);
+MmapDisk::MmapDisk(const std::string& filename, int blocks)
+    : MyDisk(blocks),
+      fd_(-1),
+      base_(nullptr),
+      length_(0),
+      filename_(filename) {}
+
+MmapDisk::~MmapDisk() {
+  if (base_) {
+    msync(base_, length_, MS_SYNC);
+    munmap(base_, length_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool MmapDisk::initialize(bool format) {
+  if (!base_) {
+    fd_ = open(filename_.c_str(), O_RDWR | (format ? O_CREAT : 0), 0644);
+    if (fd_ < 0) {
+      std::cerr << "Unable to open file." << std::endl;
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      std::cerr << "Unable to size file." << std::endl;
+      return false;
+    }
+    if (!blocks_ && !format) blocks_ = st.st_size / BLOCK_SIZE;
+    if (!blocks_) blocks_ = BLOCK_NUM;
+    // touching a page past the end of the file would SIGBUS
+    length_ = static_cast<size_t>(blocks_) * BLOCK_SIZE;
+    if (static_cast<size_t>(st.st_size) != length_ &&
+        (format || static_cast<size_t>(st.st_size) < length_) &&
+        ftruncate(fd_, length_) != 0) {
+      std::cerr << "Unable to size file." << std::endl;
+      return false;
+    }
+    void* p =
+        mmap(nullptr, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+      std::cerr << "Unable to map file." << std::endl;
+      return false;
+    }
+    base_ = static_cast<char*>(p);
+  }
+  if (format) return discard(0, blocks_);
   return true;
 }
-std::unique_ptr<DeviceBlock> MyDisk::bread(int blockNo) {
-  assert(blockNo >= 0 && blockNo < BLOCK_NUM);
-  assert(file_.is_open());
-  auto b = std::make_unique<DeviceBlock>();
-  file_.seekg(blockNo * BLOCK_SIZE);
-  file_.read(b->s_, BLOCK_SIZE);
-  return b;
-}
\ No newline at end of file
+
+bool MmapDisk::breadv(const struct iovec* iov, int iovcnt, int blockNo) {
+  assert(base_);
+  size_t off = static_cast<size_t>(blockNo) * BLOCK_SIZE;
+  for (int i = 0; i < iovcnt; i++) {
+    assert(iov[i].iov_len % BLOCK_SIZE == 0);
+    assert(off + iov[i].iov_len <= length_);
+    memcpy(iov[i].iov_base, base_ + off, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  return true;
+}
+
+bool MmapDisk::bwritev(const struct iovec* iov, int iovcnt, int blockNo) {
+  assert(base_);
+  size_t off = static_cast<size_t>(blockNo) * BLOCK_SIZE;
+  for (int i = 0; i < iovcnt; i++) {
+    assert(iov[i].iov_len % BLOCK_SIZE == 0);
+    assert(off + iov[i].iov_len <= length_);
+    // a borrowed page is written in place
+    if (base_ + off != iov[i].iov_base)
+      memcpy(base_ + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  return true;
+}
+
+bool MmapDisk::flush() { return msync(base_, length_, MS_SYNC) == 0; }
+
+bool MmapDisk::discard(int blockNo, int count) {
+  assert(base_);
+  // punch the page aligned middle out of the file, memset the edges
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = static_cast<size_t>(blockNo) * BLOCK_SIZE;
+  size_t end = start + static_cast<size_t>(count) * BLOCK_SIZE;
+  assert(end <= length_);
+  size_t lo = (start + page - 1) / page * page;
+  size_t hi = end / page * page;
+  if (lo + MIN_PAGE_DROP <= hi &&
+      madvise(base_ + lo, hi - lo, MADV_REMOVE) == 0) {
+    memset(base_ + start, 0, lo - start);
+    memset(base_ + hi, 0, end - hi);
+  } else {
+    memset(base_ + start, 0, end - start);
+  }
+  return true;
+}
+
+void MmapDisk::advise(int blockNo, int count, Advice advice) {
+  int a = advice == Advice::Sequential ? MADV_SEQUENTIAL
+          : advice == Advice::WillNeed ? MADV_WILLNEED
+                                       : MADV_NORMAL;
+  // madvise wants a page aligned start
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = static_cast<size_t>(blockNo) * BLOCK_SIZE;
+  size_t end = std::min(start + static_cast<size_t>(count) * BLOCK_SIZE,
+                        length_);
+  start = start / page * page;
+  madvise(base_ + start, end - start, a);
+}
+
+char* MmapDisk::map(int blockNo) {
+  assert(base_ && blockNo >= 0 && blockNo < blocks_);
+  return base_ + static_cast<size_t>(blockNo) * BLOCK_SIZE;
+}
+
+RamDisk::RamDisk(int blocks, bool hugePages)
+    : MyDisk(blocks),
+      base_(nullptr),
+      length_(static_cast<size_t>(blocks) * BLOCK_SIZE),
+      hugePages_(hugePages) {
+  assert(blocks > 0);
+}
+
+RamDisk::~RamDisk() {
+  if (base_) munmap(base_, length_);
+}
+
+bool RamDisk::initialize(bool format) {
+  if (base_) {
+    if (format) return discard(0, blocks_);
+    return true;
+  }
+  void* p = MAP_FAILED;
+  if (hugePages_)
+    p = mmap(nullptr, length_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) {
+    p = mmap(nullptr, length_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED && hugePages_) madvise(p, length_, MADV_HUGEPAGE);
+  }
+  if (p == MAP_FAILED) {
+    std::cerr << "Unable to allocate ram disk." << std::endl;
+    return false;
+  }
+  base_ = static_cast<char*>(p);
+  return true;
+}
+
+bool RamDisk::breadv(const struct iovec* iov, int iovcnt, int blockNo) {
+  assert(base_);
+  size_t off = static_cast<size_t>(blockNo) * BLOCK_SIZE;
+  for (int i = 0; i < iovcnt; i++) {
+    assert(iov[i].iov_len % BLOCK_SIZE == 0);
+    assert(off + iov[i].iov_len <= length_);
+    memcpy(iov[i].iov_base, base_ + off, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  return true;
+}
+
+bool RamDisk::bwritev(const struct iovec* iov, int iovcnt, int blockNo) {
+  assert(base_);
+  size_t off = static_cast<size_t>(blockNo) * BLOCK_SIZE;
+  for (int i = 0; i < iovcnt; i++) {
+    assert(iov[i].iov_len % BLOCK_SIZE == 0);
+    assert(off + iov[i].iov_len <= length_);
+    // a borrowed block is written in place
+    if (base_ + off != iov[i].iov_base)
+      memcpy(base_ + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  return true;
+}
+
+bool RamDisk::discard(int blockNo, int count) {
+  assert(base_);
+  // anonymous pages read back as zero once dropped
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = static_cast<size_t>(blockNo) * BLOCK_SIZE;
+  size_t end = start + static_cast<size_t>(count) * BLOCK_SIZE;
+  assert(end <= length_);
+  size_t lo = (start + page - 1) / page * page;
+  size_t hi = end / page * page;
+  if (lo + MIN_PAGE_DROP <= hi &&
+      madvise(base_ + lo, hi - lo, MADV_DONTNEED) == 0) {
+    memset(base_ + start, 0, lo - start);
+    memset(base_ + hi, 0, end - hi);
+  } else {
+    memset(base_ + start, 0, end - start);
+  }
+  return true;
+}
+
+char* RamDisk::map(int blockNo) {
+  assert(base_ && static_cast<size_t>(blockNo) * BLOCK_SIZE < length_);
+  return base_ + static_cast<size_t>(blockNo) * BLOCK_SIZE;
+}
+
+std::shared_ptr<MyDisk> makeDisk(const std::string& spec, int blocks) {
+  if (spec == "ram" || spec == "ram:huge")
+    return std::make_shared<RamDisk>(blocks ? blocks : BLOCK_NUM,
+                                     spec == "ram:huge");
+  // a path may hold colons of its own: only a known backend is a prefix
+  auto pos = spec.find(':');
+  std::string backend = pos == std::string::npos ? "" : spec.substr(0, pos);
+  if (backend != "file" && backend != "mmap" && backend != "uring")
+    return std::make_shared<FileDisk>(spec, blocks);
+  std::string path = spec.substr(pos + 1);
+  if (backend == "mmap") return std::make_shared<MmapDisk>(path, blocks);
+  if (backend == "uring") return std::make_shared<UringDisk>(path, blocks);
+  return std::make_shared<FileDisk>(path, blocks);
+}
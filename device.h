@@ -1,24 +1,183 @@
 #pragma once
-#include <fstream>
+#include <sys/uio.h>
+
 #include <memory>
 #include <string>
+#include <vector>
+// Device blocks are always 1 KiB; the filesystem block size is chosen at
+// mkfs time (SuperBlock::s_log_block_size_).
 constexpr int BLOCK_SIZE = 1024;
+// size of a newly formatted image when none is given
 constexpr int BLOCK_NUM = 32768;
 
 struct DeviceBlock {
   char s_[BLOCK_SIZE];
 };
 
+// Block device interface. Backends implement contiguous vectored I/O; the
+// single-block and scattered forms are built on top of it.
 class MyDisk {
  public:
-  MyDisk(const std::string& filename);
-  ~MyDisk();
+  enum class Advice { Normal, Sequential, WillNeed };
+
+  // One asynchronous vectored transfer of the consecutive blocks starting at
+  // blockNo_. iov_ and the buffers must stay valid until wait() returns.
+  struct Request {
+    bool write_;
+    int blockNo_;
+    const struct iovec* iov_;
+    int iovcnt_;
+  };
+
+  explicit MyDisk(int blocks = 0) : blocks_(blocks) {}
+  virtual ~MyDisk() = default;
 
-  bool initialize(bool format = false);
+  // With format the device is (re)created with blockCount() blocks, zeroed.
+  virtual bool initialize(bool format = false) = 0;
+  // Device size in blocks; for image files opened without an explicit size
+  // it is known once initialize() has succeeded.
+  int blockCount() const { return blocks_; }
   bool bwrite(const DeviceBlock* b, int blockNo);
   std::unique_ptr<DeviceBlock> bread(int blockNo);
+  // fills a caller supplied block instead of allocating one
+  bool bread(int blockNo, DeviceBlock* b);
+
+  // Vectored I/O over the consecutive blocks starting at blockNo. Every
+  // iov_len must be a multiple of BLOCK_SIZE.
+  virtual bool breadv(const struct iovec* iov, int iovcnt, int blockNo) = 0;
+  virtual bool bwritev(const struct iovec* iov, int iovcnt, int blockNo) = 0;
+  // Scattered I/O: block blockNos[i] goes to/from bufs[i]. One request is
+  // issued per run of consecutive block numbers.
+  bool breadv(const int* blockNos, DeviceBlock* const* bufs, int n);
+  bool bwritev(const int* blockNos, const DeviceBlock* const* bufs, int n);
+
+  // Asynchronous I/O: submit() queues a batch of requests, wait() reaps every
+  // outstanding completion and reports whether all of them succeeded. The
+  // default implementation completes each request synchronously in submit().
+  virtual bool submit(const Request* reqs, int n);
+  virtual bool wait() { return true; }
+
+  // Makes every completed write durable.
+  virtual bool flush() { return true; }
+  // Zeroes blocks [blockNo, blockNo + count), releasing their storage where
+  // the backend can. The default writes zeros.
+  virtual bool discard(int blockNo, int count);
+  // Access pattern hint for blocks [blockNo, blockNo + count).
+  virtual void advise(int /*blockNo*/, int /*count*/, Advice /*advice*/) {}
+  // Address of block blockNo if the backend keeps the image in memory, so
+  // callers may borrow it instead of copying; nullptr otherwise.
+  virtual char* map(int /*blockNo*/) { return nullptr; }
+
+ protected:
+  int blocks_;
+};
+
+// Image file accessed with positional pread/pwrite, so there is no shared
+// file offset between callers. blocks == 0 takes the size of the existing
+// file, or BLOCK_NUM when formatting.
+class FileDisk : public MyDisk {
+ public:
+  FileDisk(const std::string& filename, int blocks = 0);
+  ~FileDisk();
+
+  bool initialize(bool format = false) override;
+  using MyDisk::breadv;
+  using MyDisk::bwritev;
+  bool breadv(const struct iovec* iov, int iovcnt, int blockNo) override;
+  bool bwritev(const struct iovec* iov, int iovcnt, int blockNo) override;
+  bool flush() override;
+  bool discard(int blockNo, int count) override;
+  void advise(int blockNo, int count, Advice advice) override;
+
+ protected:
+  bool transfer(bool write, const struct iovec* iov, int iovcnt, int blockNo);
+
+  int fd_;
+  std::string filename_;
+};
+
+struct UringRing;
+
+// FileDisk whose submit()/wait() go through an io_uring: a whole batch is
+// handed to the kernel with one io_uring_enter and the completions are
+// reaped together. Falls back to FileDisk's synchronous path when io_uring is
+// not available at build or run time.
+class UringDisk : public FileDisk {
+ public:
+  UringDisk(const std::string& filename, int blocks = 0,
+            unsigned entries = 256);
+  ~UringDisk();
+
+  bool initialize(bool format = false) override;
+  bool submit(const Request* reqs, int n) override;
+  bool wait() override;
+  // false if running on the synchronous fallback
+  bool async() const { return ring_ != nullptr; }
+
+ private:
+  // submits the last queued entries, taking back any the kernel refused
+  bool push(unsigned queued, unsigned min_complete);
+  bool enter(unsigned to_submit, unsigned min_complete);
+  void reap();
+
+  std::unique_ptr<UringRing> ring_;
+  unsigned entries_;
+  std::vector<Request> inflight_;
+  unsigned submitted_;
+  unsigned completed_;
+  bool ok_;
+};
+
+// Image file mapped into memory with MAP_SHARED. Reads and writes are
+// memcpy, map() lends out the pages, and flush() is msync. Sized like
+// FileDisk.
+class MmapDisk : public MyDisk {
+ public:
+  MmapDisk(const std::string& filename, int blocks = 0);
+  ~MmapDisk();
+
+  bool initialize(bool format = false) override;
+  using MyDisk::breadv;
+  using MyDisk::bwritev;
+  bool breadv(const struct iovec* iov, int iovcnt, int blockNo) override;
+  bool bwritev(const struct iovec* iov, int iovcnt, int blockNo) override;
+  bool flush() override;
+  bool discard(int blockNo, int count) override;
+  void advise(int blockNo, int count, Advice advice) override;
+  char* map(int blockNo) override;
 
  private:
-  std::fstream file_;
+  int fd_;
+  char* base_;
+  size_t length_;
   std::string filename_;
 };
+
+// Disk held entirely in memory, in one page aligned anonymous mapping.
+// Contents are lost when it is destroyed. With hugePages the mapping is
+// backed by huge pages (MAP_HUGETLB, falling back to transparent huge pages)
+// to cut TLB misses on large images.
+class RamDisk : public MyDisk {
+ public:
+  RamDisk(int blocks = BLOCK_NUM, bool hugePages = false);
+  ~RamDisk();
+
+  bool initialize(bool format = false) override;
+  using MyDisk::breadv;
+  using MyDisk::bwritev;
+  bool breadv(const struct iovec* iov, int iovcnt, int blockNo) override;
+  bool bwritev(const struct iovec* iov, int iovcnt, int blockNo) override;
+  bool discard(int blockNo, int count) override;
+  char* map(int blockNo) override;
+
+ private:
+  char* base_;
+  size_t length_;
+  bool hugePages_;
+};
+
+// Opens a disk from a "[backend:]path" spec, backend being "file" (the
+// default), "mmap" or "uring"; any other prefix is part of the path. "ram"
+// and "ram:huge" give a RamDisk. blocks is the device size, 0 for the
+// backend's default.
+std::shared_ptr<MyDisk> makeDisk(const std::string& spec, int blocks = 0);
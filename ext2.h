@@ -14,6 +14,10 @@
 // block 4     1 block       inode bitmap
 // block 5     23 blocks     inode table
 // block 28    1412 blocks   data blocks
+//
+// With 2 KiB or 4 KiB blocks the superblock still starts at byte 1024, which
+// is inside block 0, so s_first_data_block_ is 0 and group 0 starts there.
+// The descriptor table follows the superblock and may span several blocks.
 
 struct SuperBlock {
   uint32_t s_inodes_count_;       // Inodes count
@@ -56,10 +60,6 @@ struct Block_Group_Descriptor {
   uint32_t bg_reserved_[3];
 };
 
-struct Block_Group_Descriptor_Table {
-  Block_Group_Descriptor bg_desc_[BLOCK_SIZE / sizeof(Block_Group_Descriptor)];
-};
-
 struct inode {
   uint16_t i_mode_;         // File mode
   uint16_t i_uid_;          // Low 16 bits of Owner Uid
@@ -81,8 +81,30 @@ struct inode {
   uint32_t i_osd2_[3];      // OS dependent 2
 };
 
-struct inode_table {
-  inode inodes_[BLOCK_SIZE / sizeof(inode)];
+// Extent tree, laid out as in ext4. With EXT4_EXTENTS_FL, i_block_ holds a
+// header and four entries instead of block pointers; deeper nodes are whole
+// blocks. Index nodes (depth > 0) point at the nodes below them, leaves
+// (depth 0) hold extents, both sorted by logical block.
+struct Extent_Header {
+  uint16_t eh_magic_;       // EXT4_EXT_MAGIC
+  uint16_t eh_entries_;     // Number of valid entries
+  uint16_t eh_max_;         // Capacity of the node
+  uint16_t eh_depth_;       // Levels below this node, 0 for a leaf
+  uint32_t eh_generation_;  // Unused
+};
+
+struct Extent_Leaf {
+  uint32_t ee_block_;     // First logical block
+  uint16_t ee_len_;       // Number of blocks
+  uint16_t ee_start_hi_;  // High 16 bits of the first physical block
+  uint32_t ee_start_lo_;  // Low 32 bits of the first physical block
+};
+
+struct Extent_Index {
+  uint32_t ei_block_;    // First logical block below this entry
+  uint32_t ei_leaf_lo_;  // Low 32 bits of the node below
+  uint16_t ei_leaf_hi_;  // High 16 bits of the node below
+  uint16_t ei_unused_;
 };
 
 struct dentry {
@@ -92,11 +114,44 @@ struct dentry {
   uint8_t file_type_;
 };
 
+// Hashed directory index (htree), laid out as in ext4. Block 0 of an indexed
+// directory holds "." and "..", with ".." stretched to the end of the block;
+// Dx_Root_Info and the root's entries sit in that slack. Index nodes below
+// the root are blocks holding one empty dentry over the whole block,
+// followed by their entries. Entries are sorted by hash and point at the
+// block holding the names hashing from their hash up to the next entry's;
+// the first entry's hash is replaced by the node's count and limit. Leaves
+// are ordinary dentry blocks.
+struct Dx_Root_Info {
+  uint32_t reserved_zero_;
+  uint8_t hash_version_;     // EXT2_HASH_LEGACY
+  uint8_t info_length_;      // sizeof(Dx_Root_Info)
+  uint8_t indirect_levels_;  // Index levels below the root
+  uint8_t unused_flags_;
+};
+
+struct Dx_Countlimit {
+  uint16_t limit_;  // Capacity of the node
+  uint16_t count_;  // Entries in use, this one included
+};
+
+struct Dx_Entry {
+  uint32_t hash_;   // Lowest hash below; bit 0 set if the hash continues
+                    // from the block before
+  uint32_t block_;  // Logical block below
+};
+
 #define EXT2_SUPER_MAGIC (0xEF53)
 
 #define EXT2_ERROR_FS (1)
 #define EXT2_VALID_FS (2)
 
+#define EXT2_INDEX_FL (0x1000)     // Directory uses a hashed index
+#define EXT2_HASH_LEGACY (0)
+#define EXT4_EXTENTS_FL (0x80000)  // Inode uses an extent tree
+#define EXT4_EXT_MAGIC (0xF30A)
+#define EXT4_EXT_MAX_LEN (32768)  // Longest extent
+
 #define EXT2_S_IFREG (0x8000)
 #define EXT2_S_IFDIR (0x4000)
 #define EXT2_S_IFLNK (0xA000)
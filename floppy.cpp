@@ -1,5 +1,6 @@
 #include "floppy.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
@@ -13,7 +14,7 @@ MyFS::MyFS(std::shared_ptr<MyDisk> bd) {
   im_ = std::make_shared<InodeManager>(sbm_, bm_);
 }
 MyFS::MyFS(const std::string& filename) {
-  auto bd = std::make_shared<MyDisk>(filename);
+  auto bd = makeDisk(filename);
   assert(bd->initialize());
   sbm_ = std::make_shared<SuperBlockManager>(bd);
   bm_ = std::make_shared<BlockManager>(bd, sbm_);
@@ -21,48 +22,65 @@ MyFS::MyFS(const std::string& filename) {
 }
 
 bool MyFS::readdir(const std::string& dir, inode* in, uint32_t* iid) const {
-  if (dir.empty()) {
-    if (in) *in = im_->read_inode(1);
-    if (iid) *iid = 1;
-    return true;
-  }
-  auto path = splitPath(dir);
-  assert(path.size() && path[0].size() == 0);
-  uint32_t cur_dir_iid{1};
-  auto cur_inode = im_->read_inode(cur_dir_iid);
-  for (int i = 1; i < path.size(); i++) {
-    const auto& match_name = path[i];
-    assert(i == path.size() - 1 || cur_inode.i_mode_ & EXT2_S_IFDIR);
-    if (!im_->find_next(cur_inode, match_name, &cur_dir_iid)) {
-      return false;
+  uint32_t piid, ciid;
+  inode pin;
+  std::string name;
+  if (resolve(dir, &piid, &pin, &name, &ciid) || !ciid) return false;
+  if (in) *in = im_->read_inode(ciid);
+  if (iid) *iid = ciid;
+  return true;
+}
+
+int MyFS::resolve(std::string_view path, uint32_t* piid, inode* pin,
+                  std::string* name, uint32_t* iid) const {
+  assert(path.empty() || path[0] == '/');
+  *piid = *iid = 1;
+  *pin = im_->read_inode(1);
+  name->clear();
+  PathWalker walk(path);
+  std::string_view cur, next;
+  if (!walk.next(&cur)) return 0;
+  for (;;) {
+    if (!(pin->i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
+    // one buffer for every component: no allocation past the longest name
+    name->assign(cur);
+    bool found = im_->lookup(*piid, *name, iid);
+    if (!walk.next(&next)) {
+      if (!found) *iid = 0;
+      return 0;
     }
-    cur_inode = im_->read_inode(cur_dir_iid);
+    if (!found) return -ENOENT;
+    *piid = *iid;
+    *pin = im_->read_inode(*piid);
+    cur = next;
   }
-  if (in) *in = cur_inode;
-  if (iid) *iid = cur_dir_iid;
-  return true;
 }
 
-std::unique_ptr<MyFS> MyFS::skipInit() {
-  auto my_fs = std::make_unique<MyFS>("/home/iamswing/myfs/simdisk.img");
+std::unique_ptr<MyFS> MyFS::skipInit(const std::string& spec) {
+  auto my_fs = std::make_unique<MyFS>(spec);
   return my_fs;
 }
 
-std::unique_ptr<MyFS> MyFS::mytest() {
-  auto bd = std::make_shared<MyDisk>("/home/iamswing/myfs/simdisk.img");
+std::unique_ptr<MyFS> MyFS::mytest(const std::string& spec,
+                                   uint32_t log_block_size) {
+  return mytest(makeDisk(spec), log_block_size);
+}
+
+std::unique_ptr<MyFS> MyFS::mytest(std::shared_ptr<MyDisk> bd,
+                                   uint32_t log_block_size) {
   assert(bd->initialize(true));
-  ImgMaker::initFloppyPlus(bd);
+  ImgMaker::mkfs(bd, log_block_size);
   return std::make_unique<MyFS>(bd);
 }
 
 int MyFS::read(const std::string& dir, char* buf, size_t size,
-               uint64_t offset) const {
+               uint64_t offset, InodeManager::Readahead* ra) const {
   inode inode;
   uint32_t iid;
   if (!readdir(dir, &inode, &iid)) return -ENOENT;
   if (offset >= inode.i_size_) return 0;
   if (offset + size > inode.i_size_) size = inode.i_size_ - offset;
-  return im_->read_inode_data(iid, buf, offset, size);
+  return im_->read_inode_data(iid, buf, offset, size, ra);
 }
 
 int MyFS::write(const std::string& dir, const char* buf, size_t size,
@@ -72,7 +90,12 @@ int MyFS::write(const std::string& dir, const char* buf, size_t size,
   if (!readdir(dir, &inode, &iid)) return -ENOENT;
   if (!(inode.i_mode_ & EXT2_S_IFREG)) return -EISDIR;
   if (offset + size > inode.i_size_) im_->resize(iid, offset + size);
-  return im_->write_inode_data(iid, buf, offset, size);
+  size_t written = im_->write_inode_data(iid, buf, offset, size);
+  if (written == size) return written;
+  // the disk filled up: the file ends where the data does
+  if (offset + size > inode.i_size_)
+    im_->resize(iid, std::max<size_t>(inode.i_size_, offset + written));
+  return written ? int(written) : -ENOSPC;
 }
 
 int MyFS::truncate(const std::string& dir, uint64_t size) {
@@ -86,33 +109,38 @@ int MyFS::truncate(const std::string& dir, uint64_t size) {
 
 int MyFS::mkdir(const std::string& dir, const inode& in) {
   inode inode;
-  uint32_t iid;
-  if (readdir(dir, &inode, &iid)) return -EEXIST;
+  uint32_t iid, ciid;
+  std::string cName;
+  if (int err = resolve(dir, &iid, &inode, &cName, &ciid)) return err;
+  if (ciid) return -EEXIST;
 
-  auto [pName, cName] = splitPathParent(dir);
-  if (!readdir(pName, &inode, &iid)) return -ENOENT;
-  if (!(inode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
+  uint32_t new_iid = im_->new_inode(in);
+  int err = im_->dir_add_dentry(new_iid, new_iid, ".", EXT2_FT_DIR);
+  if (!err) err = im_->dir_add_dentry(new_iid, iid, "..", EXT2_FT_DIR);
+  if (!err) err = im_->dir_add_dentry(iid, new_iid, cName, EXT2_FT_DIR);
+  if (err) {
+    im_->resize(new_iid, 0);
+    im_->del_inode(new_iid);
+    return err;
+  }
+  inode = im_->read_inode(iid);
   inode.i_links_count_++;
   im_->write_inode(inode, iid);
-
-  uint32_t new_iid = im_->new_inode(in);
-  im_->dir_add_dentry(new_iid, new_iid, ".", EXT2_FT_DIR);
-  im_->dir_add_dentry(new_iid, iid, "..", EXT2_FT_DIR);
-  im_->dir_add_dentry(iid, new_iid, cName, EXT2_FT_DIR);
   return 0;
 }
 
 int MyFS::create(const std::string& dir, const inode& in) {
   inode inode;
-  uint32_t iid;
-  if (readdir(dir, &inode, &iid)) return -EEXIST;
-
-  auto [pName, cName] = splitPathParent(dir);
-  if (!readdir(pName, &inode, &iid)) return -ENOENT;
-  if (!(inode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
+  uint32_t iid, ciid;
+  std::string cName;
+  if (int err = resolve(dir, &iid, &inode, &cName, &ciid)) return err;
+  if (ciid) return -EEXIST;
 
   uint32_t new_iid = im_->new_inode(in);
-  im_->dir_add_dentry(iid, new_iid, cName, EXT2_FT_REG_FILE);
+  if (int err = im_->dir_add_dentry(iid, new_iid, cName, EXT2_FT_REG_FILE)) {
+    im_->del_inode(new_iid);
+    return err;
+  }
   return 0;
 }
 
@@ -130,36 +158,51 @@ int MyFS::readlink(const std::string& path, char* buf, size_t size) {
   return 0;
 }
 
+int MyFS::statfs(struct statvfs* st) const {
+  const auto& sb = sbm_->readSuperBlock();
+  memset(st, 0, sizeof(struct statvfs));
+  st->f_bsize = st->f_frsize = 1024 << sb.s_log_block_size_;
+  st->f_blocks = sb.s_blocks_count_ - sb.s_first_data_block_;
+  st->f_bfree = st->f_bavail = bm_->freeBlocks();
+  st->f_files = bm_->bgd_.size() * sb.s_inodes_per_group_;
+  st->f_ffree = st->f_favail = bm_->freeInodes();
+  st->f_namemax = 255;
+  return 0;
+}
+
 int MyFS::symlink(const std::string& target, const std::string& linkpath,
                   const inode& in) {
-  uint32_t p_iid;
+  uint32_t p_iid, c_iid;
   inode pinode;
-
-  auto [pName, cName] = splitPathParent(linkpath);
-
-  if (!readdir(pName, &pinode, &p_iid)) return -ENOENT;
-  if (!(pinode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
+  std::string cName;
+  if (int err = resolve(linkpath, &p_iid, &pinode, &cName, &c_iid))
+    return err;
+  if (c_iid) return -EEXIST;
 
   uint32_t new_iid = im_->new_inode(in);
   im_->resize(new_iid, target.size());
 
-  im_->write_inode_data(new_iid, target.c_str(), 0, target.size());
-
-  im_->dir_add_dentry(p_iid, new_iid, cName, EXT2_FT_SYMLINK);
-
+  int err = im_->write_inode_data(new_iid, target.c_str(), 0,
+                                  target.size()) < target.size()
+                ? -ENOSPC
+                : im_->dir_add_dentry(p_iid, new_iid, cName, EXT2_FT_SYMLINK);
+  if (err) {
+    im_->resize(new_iid, 0);
+    im_->del_inode(new_iid);
+    return err;
+  }
   return 0;
 }
 
 int MyFS::unlink(const std::string& dir) {
   inode pnode, cnode;
   uint32_t piid, ciid;
-  if (!readdir(dir, &cnode, &ciid)) return -ENOENT;
+  std::string cName;
+  if (int err = resolve(dir, &piid, &pnode, &cName, &ciid)) return err;
+  if (!ciid) return -ENOENT;
+  cnode = im_->read_inode(ciid);
   if (!(cnode.i_mode_ & EXT2_S_IFREG)) return -EISDIR;
 
-  auto [pName, cName] = splitPathParent(dir);
-  if (!readdir(pName, &pnode, &piid)) return -ENOENT;
-  if (!(pnode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
-
   im_->dir_del_dentry(piid, cName);
   cnode.i_links_count_--;
   if (cnode.i_links_count_ == 0) {
@@ -178,12 +221,13 @@ int MyFS::link(const std::string& oldpath, const std::string& newpath) {
 
   if (old_inode.i_mode_ & EXT2_S_IFDIR) return -EPERM;
 
-  uint32_t piid;
+  uint32_t piid, ciid;
   inode pinode;
-  auto [pName, cName] = splitPathParent(newpath);
-  if (!readdir(pName, &pinode, &piid)) return -ENOENT;
-  if (!(pinode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
-  im_->dir_add_dentry(piid, old_iid, cName, EXT2_FT_REG_FILE);
+  std::string cName;
+  if (int err = resolve(newpath, &piid, &pinode, &cName, &ciid)) return err;
+  if (ciid) return -EEXIST;
+  if (int err = im_->dir_add_dentry(piid, old_iid, cName, EXT2_FT_REG_FILE))
+    return err;
   old_inode.i_links_count_++;
   im_->write_inode(old_inode, old_iid);
   return 0;
@@ -194,24 +238,29 @@ int MyFS::rename(const std::string& oldDir, const std::string& newDir,
   //   inode inode;
   uint32_t old_ciid{}, new_ciid{}, old_piid{}, new_piid{};
   inode old_inode, new_inode;
-  bool old_exist = readdir(oldDir, &old_inode, &old_ciid);
-  bool new_exist = readdir(newDir, &new_inode, &new_ciid);
-  if (!old_exist) return -ENOENT;
+  std::string cName, ncName;
+  int old_err = resolve(oldDir, &old_piid, &old_inode, &cName, &old_ciid);
+  int new_err = resolve(newDir, &new_piid, &new_inode, &ncName, &new_ciid);
+  if (old_err || !old_ciid) return -ENOENT;
+  bool new_exist = !new_err && new_ciid;
+  old_inode = im_->read_inode(old_ciid);
+  if (new_exist) new_inode = im_->read_inode(new_ciid);
   if (flags & RENAME_EXCHANGE) {
     if (!new_exist) return -ENOENT;
     im_->write_inode(old_inode, new_ciid);
     im_->write_inode(new_inode, old_ciid);
+    // the two inode IDs now hold each other's entries
+    im_->forget_dentries(old_ciid);
+    im_->forget_dentries(new_ciid);
     return 0;
   }
-  auto [pName, cName] = splitPathParent(oldDir);
-  auto [npName, ncName] = splitPathParent(newDir);
-  assert(readdir(pName, nullptr, &old_piid));
-  assert(readdir(npName, nullptr, &new_piid));
+  if (new_err) return new_err;
   if (new_exist && new_inode.i_mode_ & EXT2_S_IFDIR) {
     if (old_inode.i_mode_ & EXT2_S_IFDIR) {
       // both src and dst are dir
+      if (int err = im_->dir_add_dentry(new_ciid, old_ciid, cName, EXT2_FT_DIR))
+        return err;
       im_->dir_del_dentry(old_piid, cName);
-      im_->dir_add_dentry(new_ciid, old_ciid, cName, EXT2_FT_DIR);
       auto pinode = im_->read_inode(old_piid);
       pinode.i_links_count_--;
       im_->write_inode(pinode, old_piid);
@@ -222,8 +271,10 @@ int MyFS::rename(const std::string& oldDir, const std::string& newDir,
     }
     // src is file, dst is dir
 
+    if (int err =
+            im_->dir_add_dentry(new_ciid, old_ciid, cName, EXT2_FT_REG_FILE))
+      return err;
     im_->dir_del_dentry(old_piid, cName);
-    im_->dir_add_dentry(new_ciid, old_ciid, cName, EXT2_FT_REG_FILE);
     return 0;
   }
   if (new_exist && new_inode.i_mode_ & EXT2_S_IFREG &&
@@ -234,15 +285,18 @@ int MyFS::rename(const std::string& oldDir, const std::string& newDir,
     // src is file, dst is file
     if (flags & RENAME_NOREPLACE) return -EEXIST;
     unlink(newDir);
+    // takes the room the replaced entry left in the same leaf
+    int err = im_->dir_add_dentry(new_piid, old_ciid, ncName, EXT2_FT_REG_FILE);
+    assert(!err);
     im_->dir_del_dentry(old_piid, cName);
-    im_->dir_add_dentry(new_piid, old_ciid, ncName, EXT2_FT_REG_FILE);
     return 0;
   }
   assert(!new_exist);
   if (old_inode.i_mode_ & EXT2_S_IFDIR) {
     // src is dir, dst not exist
+    if (int err = im_->dir_add_dentry(new_piid, old_ciid, ncName, EXT2_FT_DIR))
+      return err;
     im_->dir_del_dentry(old_piid, cName);
-    im_->dir_add_dentry(new_piid, old_ciid, ncName, EXT2_FT_DIR);
     //
     auto pinode = im_->read_inode(old_piid);
     pinode.i_links_count_--;
@@ -253,8 +307,10 @@ int MyFS::rename(const std::string& oldDir, const std::string& newDir,
     im_->write_inode(pinode, new_piid);
   } else {
     // src is file, dst not exist
+    if (int err =
+            im_->dir_add_dentry(new_piid, old_ciid, ncName, EXT2_FT_REG_FILE))
+      return err;
     im_->dir_del_dentry(old_piid, cName);
-    im_->dir_add_dentry(new_piid, old_ciid, ncName, EXT2_FT_REG_FILE);
   }
   return 0;
 }
@@ -262,14 +318,13 @@ int MyFS::rename(const std::string& oldDir, const std::string& newDir,
 int MyFS::rmdir(const std::string& dir) {
   inode pnode, cnode;
   uint32_t piid, ciid;
-  if (!readdir(dir, &cnode, &ciid)) return -ENOENT;
+  std::string cName;
+  if (int err = resolve(dir, &piid, &pnode, &cName, &ciid)) return err;
+  if (!ciid) return -ENOENT;
+  cnode = im_->read_inode(ciid);
   if (!(cnode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
   if (!im_->dir_empty(ciid)) return -ENOTEMPTY;
 
-  auto [pName, cName] = splitPathParent(dir);
-  if (!readdir(pName, &pnode, &piid)) return -ENOENT;
-  if (!(pnode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
-
   pnode.i_links_count_--;
   im_->write_inode(pnode, piid);
 
@@ -280,10 +335,13 @@ int MyFS::rmdir(const std::string& dir) {
 }
 
 #ifndef FUSING
+#include <cstdlib>
 #include <iostream>
 
-int main() {
-  auto fs = MyFS::mytest();
+int main(int argc, char* argv[]) {
+  // floppy [disk spec] [log block size]
+  auto fs = MyFS::mytest(argc > 1 ? argv[1] : "ram",
+                         argc > 2 ? atoi(argv[2]) : 0);
   inode in;
   memset(&in, 0, sizeof(inode));
   in.i_mode_ = EXT2_S_IFREG | 0755;
@@ -294,7 +352,28 @@ int main() {
   for (int i = 0; i < 1024; i++) {
     fs->read("/test", buf, 1024, i * 1024);
   }
+  // the file is cached now: a second pass must not allocate block buffers
+  auto allocations = BlockPool::allocations();
+  for (int i = 0; i < 1024; i++) {
+    fs->read("/test", buf, 1024, i * 1024);
+  }
+  std::cout << "block buffers allocated by a warm 1 MiB read: "
+            << BlockPool::allocations() - allocations << std::endl;
+  assert(BlockPool::allocations() == allocations);
   fs->truncate("/test", 0);
+  fs->im_->flush();
+  auto& stats = fs->bm_->cacheStats();
+  std::cout << "block cache: " << stats.hits_ << " hits, " << stats.misses_
+            << " misses, " << stats.evictions_ << " evictions, "
+            << stats.writebacks_ << " writebacks" << std::endl;
+  auto& istats = fs->im_->inodeCacheStats();
+  std::cout << "inode cache: " << istats.hits_ << " hits, " << istats.misses_
+            << " misses, " << istats.writebacks_ << " table writebacks"
+            << std::endl;
+  auto& dstats = fs->im_->dentryStats();
+  std::cout << "dentry cache: " << dstats.hits_ << " hits, "
+            << dstats.negative_hits_ << " negative hits, " << dstats.misses_
+            << " misses" << std::endl;
   return 0;
 }
 #endif
\ No newline at end of file
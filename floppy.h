@@ -1,3 +1,5 @@
+#include <sys/statvfs.h>
+
 #include "InodeManager.h"
 
 class MyFS {
@@ -10,6 +12,13 @@ class MyFS {
 
   bool readdir(const std::string& dir, inode* in = nullptr,
                uint32_t* iid = nullptr) const;
+  // Walks path once, down to the directory holding its last component, and
+  // looks that component up there. Returns -ENOENT or -ENOTDIR if the
+  // directory cannot be reached; otherwise *piid and *pin are the
+  // directory, *name the component and *iid its inode ID, 0 if absent. The
+  // root is its own parent.
+  int resolve(std::string_view path, uint32_t* piid, inode* pin,
+              std::string* name, uint32_t* iid) const;
 
   int rmdir(const std::string& path);
   int rename(const std::string& oldpath, const std::string& newpath,
@@ -19,17 +28,24 @@ class MyFS {
   int mkdir(const std::string& path, const inode& in);
   int create(const std::string& path, const inode& in);
   int truncate(const std::string& path, uint64_t size);
-  int read(const std::string& path, char* buf, size_t size,
-           uint64_t offset) const;
+  // ra: readahead state of the open file, see InodeManager::read_inode_data
+  int read(const std::string& path, char* buf, size_t size, uint64_t offset,
+           InodeManager::Readahead* ra = nullptr) const;
   int write(const std::string& path, const char* buf, size_t size,
             off_t offset);
   int symlink(const std::string& target, const std::string& linkpath,
               const inode& in);
   int readlink(const std::string& path, char* buf, size_t size);
+  int statfs(struct statvfs* st) const;
 
   // test
-  static std::unique_ptr<MyFS> mytest();
-  static std::unique_ptr<MyFS> skipInit();
+  // format bd with 1024 << log_block_size byte blocks and mount it
+  static std::unique_ptr<MyFS> mytest(std::shared_ptr<MyDisk> bd,
+                                      uint32_t log_block_size = 0);
+  // spec is a makeDisk() spec such as "ram" or "mmap:/path/to/img"
+  static std::unique_ptr<MyFS> mytest(const std::string& spec,
+                                      uint32_t log_block_size = 0);
+  static std::unique_ptr<MyFS> skipInit(const std::string& spec);
 
   std::shared_ptr<SuperBlockManager> sbm_;
   std::shared_ptr<BlockManager> bm_;
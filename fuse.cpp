@@ -6,6 +6,7 @@
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <mutex>
 
@@ -14,20 +15,81 @@
 std::unique_ptr<MyFS> my_fs = nullptr;
 std::mutex my_mutex;
 
+// what fi->fh points to
+struct OpenFile {
+  uint32_t iid_;
+  InodeManager::Readahead ra_;
+};
+
 static void *my_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
   (void)conn;
   (void)cfg;
-  my_fs = std::move(MyFS::mytest());
+  // e.g. MYFS_DISK=mmap:/path/to/simdisk.img; a RAM disk by default
+  const char *spec = getenv("MYFS_DISK");
+  // MYFS_FORMAT=0 mounts the filesystem already on MYFS_DISK instead of
+  // formatting it
+  const char *format = getenv("MYFS_FORMAT");
+  // optional image size in MiB and block size in bytes (1024, 2048, 4096)
+  const char *size = getenv("MYFS_SIZE_MB");
+  const char *block_size = getenv("MYFS_BLOCK_SIZE");
+  // largest readahead window in KiB, 0 disables readahead
+  const char *readahead = getenv("MYFS_READAHEAD_KB");
+  // MYFS_EXTENTS=0 maps new files with indirect blocks instead of extents
+  const char *extents = getenv("MYFS_EXTENTS");
+  // MYFS_DIR_INDEX=0 keeps growing directories linear
+  const char *dir_index = getenv("MYFS_DIR_INDEX");
+  uint32_t log_block_size = 0;
+  if (block_size)
+    while ((1024 << log_block_size) < atoi(block_size)) log_block_size++;
+  if (format && !atoi(format)) {
+    if (!spec) {
+      fprintf(stderr, "myfs: MYFS_FORMAT=0 needs an image in MYFS_DISK\n");
+      exit(1);
+    }
+    my_fs = MyFS::skipInit(spec);
+  } else {
+    my_fs = MyFS::mytest(makeDisk(spec ? spec : "ram",
+                                  size ? atoi(size) * 1024 : 0),
+                         log_block_size);
+  }
+  if (readahead) my_fs->im_->readaheadLimit(atoi(readahead) * 1024);
+  if (extents) my_fs->im_->useExtents(atoi(extents));
+  if (dir_index) my_fs->im_->useDirIndex(atoi(dir_index));
 
   return nullptr;
 }
 
+static void my_destroy(void *private_data) {
+  (void)private_data;
+  std::lock_guard<std::mutex> guard(my_mutex);
+  // unmounting cannot fail, but data can be lost: say so
+  if (!my_fs->im_->flush())
+    fprintf(stderr, "myfs: I/O error writing back at unmount\n");
+  // dropping the filesystem marks it clean, unless the device fails again
+  my_fs.reset();
+}
+
+static int my_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  (void)path;
+  (void)datasync;
+  (void)fi;
+  std::lock_guard<std::mutex> guard(my_mutex);
+  return my_fs->im_->flush() ? 0 : -EIO;
+}
+
+static int my_statfs(const char *path, struct statvfs *st) {
+  (void)path;
+  std::lock_guard<std::mutex> guard(my_mutex);
+  assert(my_fs);
+  return my_fs->statfs(st);
+}
+
 static int my_read(const char *path, char *buf, size_t size, off_t offset,
                    struct fuse_file_info *fi) {
-  (void)fi;
   std::lock_guard<std::mutex> guard(my_mutex);
   assert(my_fs);
-  return my_fs->read(path, buf, size, offset);
+  auto file = reinterpret_cast<OpenFile *>(fi->fh);
+  return my_fs->read(path, buf, size, offset, file ? &file->ra_ : nullptr);
 }
 
 static int my_write(const char *path, const char *buf, size_t size,
@@ -45,13 +107,18 @@ static int hello_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   std::lock_guard<std::mutex> guard(my_mutex);
   assert(my_fs);
   inode inode;
-  if (!my_fs->readdir(path, &inode)) return -ENOENT;
+  uint32_t iid;
+  if (!my_fs->readdir(path, &inode, &iid)) return -ENOENT;
   if (!(inode.i_mode_ & EXT2_S_IFDIR)) return -ENOTDIR;
-  for (auto iter = my_fs->im_->dentry_begin(&inode);
+  char name[256];
+  for (auto iter = my_fs->im_->dentry_begin(&inode, iid);
        iter != my_fs->im_->dentry_end(&inode); ++iter) {
-    std::string name = iter.cur_dentry_name();
-    if (name[0] == '.') continue;
-    filler(buf, name.c_str(), NULL, 0, FUSE_FILL_DIR_PLUS);
+    auto entry = iter.cur_dentry_name();
+    if (entry == "." || entry == "..") continue;
+    // the name is not terminated in the block
+    memcpy(name, entry.data(), entry.size());
+    name[entry.size()] = '\0';
+    filler(buf, name, NULL, 0, FUSE_FILL_DIR_PLUS);
   }
   return 0;
 }
@@ -138,6 +205,23 @@ static int hello_open(const char *path, struct fuse_file_info *fi) {
       return -EACCES;
   }
   if (fi->flags & O_TRUNC) my_fs->truncate(path, 0);
+  // keep the inode cached while the file is open
+  uint32_t iid;
+  if (my_fs->readdir(path, nullptr, &iid)) {
+    my_fs->im_->acquire_inode(iid);
+    fi->fh = reinterpret_cast<uint64_t>(new OpenFile{iid, {}});
+  }
+  return 0;
+}
+
+static int my_release(const char *path, struct fuse_file_info *fi) {
+  (void)path;
+  std::lock_guard<std::mutex> guard(my_mutex);
+  auto file = reinterpret_cast<OpenFile *>(fi->fh);
+  if (file) {
+    my_fs->im_->release_inode(file->iid_);
+    delete file;
+  }
   return 0;
 }
 
@@ -152,7 +236,14 @@ static int my_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
   inode.i_atime_ = time(nullptr);
   inode.i_ctime_ = time(nullptr);
   inode.i_mtime_ = time(nullptr);
-  return my_fs->create(path, inode);
+  int ret = my_fs->create(path, inode);
+  // released in my_release, like a file opened with hello_open
+  uint32_t iid;
+  if (ret == 0 && my_fs->readdir(path, nullptr, &iid)) {
+    my_fs->im_->acquire_inode(iid);
+    fi->fh = reinterpret_cast<uint64_t>(new OpenFile{iid, {}});
+  }
+  return ret;
 }
 
 static int my_unlink(const char *path) {
@@ -190,7 +281,7 @@ static int hello_getattr(const char *path, struct stat *stbuf,
   stbuf->st_ctime = inode.i_ctime_;
   stbuf->st_mtime = inode.i_mtime_;
   stbuf->st_nlink = inode.i_links_count_;
-  stbuf->st_blksize = BLOCK_SIZE;
+  stbuf->st_blksize = 1024 << my_fs->sbm_->readSuperBlock().s_log_block_size_;
   stbuf->st_blocks = inode.i_blocks_;
   return 0;
 }
@@ -262,8 +353,12 @@ static struct fuse_operations my_oper = {
     .open = hello_open,
     .read = my_read,
     .write = my_write,
+    .statfs = my_statfs,
+    .release = my_release,
+    .fsync = my_fsync,
     .readdir = hello_readdir,
     .init = my_init,
+    .destroy = my_destroy,
     .create = my_create,
     .utimens = my_utimens,
 };
@@ -1,143 +1,123 @@
 #include "img.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <vector>
 
 #include "InodeManager.h"
 #include "util.h"
-void ImgMaker::initFloppy(std::shared_ptr<MyDisk> bd) {
-  auto sbm_ = std::make_shared<SuperBlockManager>(bd);
-  auto bm_ = std::make_shared<BlockManager>(bd, sbm_, false);
-  auto im_ = std::make_shared<InodeManager>(sbm_, bm_);
-  SuperBlock sb;
-  memset(&sb, 0, sizeof(SuperBlock));
-  // Initialize superblock
-  //   sb_.s_inodes_count_ = ? ;
-  sb.s_blocks_count_ = 1440;
-  // sb_.s_r_blocks_count_ = ;
-  // sb_.s_free_blocks_count_ = 1439;
-  // sb_.s_free_inodes_count_ = ;
-  sb.s_first_data_block_ = 1;
-  sb.s_log_block_size_ = 0;
-  // sb_.s_log_frag_size_ = ;
-  sb.s_blocks_per_group_ = 1439;
-  // sb_.s_frags_per_group_ = ;
-  sb.s_inodes_per_group_ = 23 * (1024 / sizeof(inode));
-  sb.s_mtime_ = time(nullptr);
-  sb.s_wtime_ = time(nullptr);
-  // sb_.s_mnt_count_ = ;
-  // sb_.s_max_mnt_count_ = ;
-  sb.s_magic_ = EXT2_SUPER_MAGIC;
-  // TODO 假设这里是挂载
-  sb.s_state_ = EXT2_ERROR_FS;
-  sbm_->writeSuperBlock(&sb);
-
-  // Initialize block group descriptor table
-  FSBlock blk{std::make_unique<char[]>(1024)};
-  auto bgd = reinterpret_cast<Block_Group_Descriptor*>(blk.s_.get());
-  bgd[0].bg_block_bitmap_ = 3;
-  bgd[0].bg_inode_bitmap_ = 4;
-  bgd[0].bg_inode_table_ = 5;
-  bm_->writeBlock(blk, 2);
-  bm_->refresh();
-
-  // Initialize block bitmap
-  memset(blk.s_.get(), 0, 1024);
-  bm_->writeBlock(blk, 3);
-  for (int i = 1; i < 28; i++) {
-    // TODO: OPTIMIZE
-    bm_->tagBlock(i, 1);
-  }
-
-  // Initialize inode bitmap
-  bm_->writeBlock(blk, 4);
-  // Initialize inode table
-  bm_->writeBlock(blk, 5);
-
-  inode root_inode;
-  memset(&root_inode, 0, sizeof(inode));
-  root_inode.i_mode_ = EXT2_S_IFDIR | 777;
-  root_inode.i_links_count_ = 2;
 
-  //
-  auto iid = im_->new_inode(root_inode);
-  assert(iid == 1);
+void ImgMaker::initFloppyPlus(std::shared_ptr<MyDisk> bd) { mkfs(bd, 0); }
 
-  im_->dir_add_dentry(1, 1, ".", EXT2_FT_DIR);
-  im_->dir_add_dentry(1, 1, "..", EXT2_FT_DIR);
+// groups carrying a copy of the superblock and descriptor table
+static bool hasSuper(int group) {
+  return group == 0 || group == 1 || isPowerOf(group, 3) ||
+         isPowerOf(group, 5) || isPowerOf(group, 7);
 }
 
-void ImgMaker::initFloppyPlus(std::shared_ptr<MyDisk> bd) {
+void ImgMaker::mkfs(std::shared_ptr<MyDisk> bd, uint32_t log_block_size) {
+  assert(log_block_size <= 2 && "block size must be 1, 2 or 4 KiB");
   auto sbm_ = std::make_shared<SuperBlockManager>(bd);
   auto bm_ = std::make_shared<BlockManager>(bd, sbm_, false);
   auto im_ = std::make_shared<InodeManager>(sbm_, bm_);
+  uint32_t block_size = 1024 << log_block_size;
   SuperBlock sb;
   memset(&sb, 0, sizeof(SuperBlock));
   // Initialize superblock
-  //   sb_.s_inodes_count_ = ? ;
-  sb.s_blocks_count_ = 24577;
-  // sb_.s_r_blocks_count_ = ;
-  // sb_.s_free_blocks_count_ = 1439;
-  // sb_.s_free_inodes_count_ = ;
-  sb.s_first_data_block_ = 1;
-  sb.s_log_block_size_ = 0;
-  // sb_.s_log_frag_size_ = ;
-  sb.s_blocks_per_group_ = 8192;
-  // sb_.s_frags_per_group_ = ;
-  sb.s_inodes_per_group_ = 214 * (1024 / sizeof(inode));
+  // the superblock sits at byte 1024: block 1 with 1 KiB blocks, else block 0
+  sb.s_first_data_block_ = log_block_size == 0 ? 1 : 0;
+  sb.s_log_block_size_ = log_block_size;
+  // one bitmap block per group, one inode per 4 blocks
+  sb.s_blocks_per_group_ = 8 * block_size;
+  sb.s_inodes_per_group_ = sb.s_blocks_per_group_ / 4;
+  uint32_t itb_count = sb.s_inodes_per_group_ * sizeof(inode) / block_size;
+  uint32_t blocks = bd->blockCount() / (block_size / BLOCK_SIZE);
+  auto groups_of = [&](uint32_t blocks) {
+    return (blocks - sb.s_first_data_block_ + sb.s_blocks_per_group_ - 1) /
+           sb.s_blocks_per_group_;
+  };
+  auto gdt_blocks_of = [&](uint32_t groups) {
+    return (groups * sizeof(Block_Group_Descriptor) + block_size - 1) /
+           block_size;
+  };
+  auto overhead = [&](uint32_t group, uint32_t gdt_blocks) {
+    return (hasSuper(group) ? 1 + gdt_blocks : 0) + 2 + itb_count;
+  };
+  // a last group too small for its own metadata is left out
+  uint32_t groups = groups_of(blocks);
+  uint32_t last = blocks - sb.s_first_data_block_ -
+                  (groups - 1) * sb.s_blocks_per_group_;
+  if (groups > 1 && last <= overhead(groups - 1, gdt_blocks_of(groups))) {
+    groups--;
+    blocks = sb.s_first_data_block_ + groups * sb.s_blocks_per_group_;
+  }
+  uint32_t gdt_blocks = gdt_blocks_of(groups);
+  assert(blocks > sb.s_first_data_block_ + overhead(0, gdt_blocks) &&
+         "device too small");
+  sb.s_blocks_count_ = blocks;
+  sb.s_inodes_count_ = groups * sb.s_inodes_per_group_;
   sb.s_mtime_ = time(nullptr);
   sb.s_wtime_ = time(nullptr);
-  // sb_.s_mnt_count_ = ;
-  // sb_.s_max_mnt_count_ = ;
   sb.s_magic_ = EXT2_SUPER_MAGIC;
   // TODO 假设这里是挂载
   sb.s_state_ = EXT2_ERROR_FS;
-  sbm_->writeSuperBlock(&sb);
 
   // Initialize block group descriptor table
-  FSBlock blk{std::make_unique<char[]>(1024)};
-  auto bgd = reinterpret_cast<Block_Group_Descriptor*>(blk.s_.get());
-  bgd[0].bg_block_bitmap_ = 3;
-  bgd[0].bg_inode_bitmap_ = 4;
-  bgd[0].bg_inode_table_ = 5;
-  bgd[1].bg_block_bitmap_ = 8195;
-  bgd[1].bg_inode_bitmap_ = 8196;
-  bgd[1].bg_inode_table_ = 8197;
-  bgd[2].bg_block_bitmap_ = 16385;
-  bgd[2].bg_inode_bitmap_ = 16386;
-  bgd[2].bg_inode_table_ = 16387;
-  bm_->writeBlock(blk, 2);
+  // each group: [superblock, descriptor table], block bitmap, inode bitmap,
+  // inode table, data
+  FSBlock blk{BlockPool::get(block_size)};
+  std::vector<Block_Group_Descriptor> bgd(groups);
+  for (uint32_t group = 0; group < groups; group++) {
+    uint32_t group_bid =
+        sb.s_first_data_block_ + group * sb.s_blocks_per_group_;
+    uint32_t bid = group_bid;
+    if (hasSuper(group)) bid += 1 + gdt_blocks;
+    bgd[group].bg_block_bitmap_ = bid;
+    bgd[group].bg_inode_bitmap_ = bid + 1;
+    bgd[group].bg_inode_table_ = bid + 2;
+    uint32_t size = std::min(sb.s_blocks_per_group_, blocks - group_bid);
+    bgd[group].bg_free_blocks_count_ = size - (bid + 2 + itb_count - group_bid);
+    bgd[group].bg_free_inodes_count_ = sb.s_inodes_per_group_;
+    sb.s_free_blocks_count_ += bgd[group].bg_free_blocks_count_;
+    sb.s_free_inodes_count_ += bgd[group].bg_free_inodes_count_;
+  }
+  sbm_->writeSuperBlock(&sb);
+  auto per_block = block_size / sizeof(Block_Group_Descriptor);
+  for (uint32_t i = 0; i < gdt_blocks; i++) {
+    memset(blk.s_.get(), 0, block_size);
+    auto n = std::min<size_t>(per_block, groups - i * per_block);
+    memcpy(blk.s_.get(), &bgd[i * per_block],
+           n * sizeof(Block_Group_Descriptor));
+    bm_->writeBlock(blk, sb.s_first_data_block_ + 1 + i);
+  }
   bm_->refresh();
 
   // Initialize block bitmap
   // Initialize inode bitmap
   // Initialize inode table
-  memset(blk.s_.get(), 0, 1024);
-  for (int group = 0; group < bm_->bgd_.size(); group++) {
-    bm_->writeBlock(blk, bm_->bgd_[group].bg_block_bitmap_);
-    bm_->writeBlock(blk, bm_->bgd_[group].bg_inode_bitmap_);
-    // TODO: OPTIMIZE
-    // TODO: ASSERT 1 block bitmap ,inode tbl place just before data block
-    for (int i = 0; i < 214; i++) {
-      bm_->writeBlock(blk, bm_->bgd_[group].bg_inode_table_ + i);
-    }
-  }
-  // dont forget tag superblock and bgd
-  for (int group = 0; group < bm_->bgd_.size(); group++) {
-    if (group == 0 || group == 1 || isPowerOf(group, 3) ||
-        isPowerOf(group, 5) || isPowerOf(group, 7)) {
-      size_t sb_bid = sb.s_first_data_block_ + group * sb.s_blocks_per_group_;
-      bm_->tagBlock(sb_bid, 1);
-      bm_->tagBlock(sb_bid + 1, 1);
-    } else {
-      size_t bgd_bid = sb.s_first_data_block_ + group * sb.s_blocks_per_group_;
-      bm_->tagBlock(bgd_bid, 1);
-    }
-    bm_->tagBlock(bm_->bgd_[group].bg_block_bitmap_, 1);
-    bm_->tagBlock(bm_->bgd_[group].bg_inode_bitmap_, 1);
-    for (int i = 0; i < 214; i++) {
-      bm_->tagBlock(bm_->bgd_[group].bg_inode_table_ + i, 1);
-    }
+  for (uint32_t group = 0; group < groups; group++) {
+    auto& gd = bm_->bgd_[group];
+    // the inode table is only ever read back as zeros: punch it out instead
+    // of writing it block by block
+    bm_->zeroBlocks(gd.bg_inode_table_, itb_count);
+
+    // the whole bitmap is built here and written once: metadata up to the end
+    // of the inode table is in use, and so are the bits past the end of a
+    // short last group
+    uint32_t group_bid =
+        sb.s_first_data_block_ + group * sb.s_blocks_per_group_;
+    uint32_t used = gd.bg_inode_table_ + itb_count - group_bid;
+    uint32_t size = std::min(sb.s_blocks_per_group_, blocks - group_bid);
+    memset(blk.s_.get(), 0, block_size);
+    for (uint32_t i = 0; i < 8 * block_size; i++)
+      if (i < used || i >= size) blk.s_[i / 8] |= 1 << i % 8;
+    bm_->writeBlock(blk, gd.bg_block_bitmap_);
+
+    memset(blk.s_.get(), 0, block_size);
+    for (uint32_t i = sb.s_inodes_per_group_; i < 8 * block_size; i++)
+      blk.s_[i / 8] |= 1 << i % 8;
+    bm_->writeBlock(blk, gd.bg_inode_bitmap_);
   }
   inode root_inode;
   memset(&root_inode, 0, sizeof(inode));
@@ -150,4 +130,4 @@ void ImgMaker::initFloppyPlus(std::shared_ptr<MyDisk> bd) {
 
   im_->dir_add_dentry(1, 1, ".", EXT2_FT_DIR);
   im_->dir_add_dentry(1, 1, "..", EXT2_FT_DIR);
-}
\ No newline at end of file
+}
@@ -1,6 +1,8 @@
 #include "device.h"
 class ImgMaker {
  public:
-  static void initFloppy(std::shared_ptr<MyDisk> bd);
   static void initFloppyPlus(std::shared_ptr<MyDisk> bd);
+  // Lays out an ext2 filesystem over the whole of bd with blocks of
+  // 1024 << log_block_size bytes and creates the root directory.
+  static void mkfs(std::shared_ptr<MyDisk> bd, uint32_t log_block_size);
 };
\ No newline at end of file
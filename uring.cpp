@@ -0,0 +1,229 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "device.h"
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
+#ifdef HAVE_IO_URING
+// Raw io_uring rings, mapped from the ring fd.
+struct UringRing {
+  int fd_ = -1;
+  unsigned sq_entries_ = 0;
+  // submission queue
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  io_uring_sqe* sqes_ = nullptr;
+  // completion queue
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+
+  void* sq_ptr_ = MAP_FAILED;
+  size_t sq_len_ = 0;
+  void* cq_ptr_ = MAP_FAILED;
+  size_t cq_len_ = 0;
+  size_t sqes_len_ = 0;
+
+  ~UringRing() {
+    if (sqes_) munmap(sqes_, sqes_len_);
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_len_);
+    if (sq_ptr_ != MAP_FAILED) munmap(sq_ptr_, sq_len_);
+    if (fd_ >= 0) close(fd_);
+  }
+};
+
+static std::unique_ptr<UringRing> setupRing(unsigned entries) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  // ENOSYS, EPERM (seccomp, sysctl) ...: stay synchronous
+  if (fd < 0) return nullptr;
+  auto r = std::make_unique<UringRing>();
+  r->fd_ = fd;
+  r->sq_entries_ = p.sq_entries;
+  r->sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) r->sq_len_ = r->cq_len_ = std::max(r->sq_len_, r->cq_len_);
+
+  r->sq_ptr_ = mmap(nullptr, r->sq_len_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr_ == MAP_FAILED) return nullptr;
+  r->cq_ptr_ = single ? r->sq_ptr_
+                      : mmap(nullptr, r->cq_len_, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  if (r->cq_ptr_ == MAP_FAILED) return nullptr;
+  r->sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, r->sqes_len_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return nullptr;
+  r->sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  auto sq = static_cast<char*>(r->sq_ptr_);
+  r->sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  r->sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  r->sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  r->sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  auto cq = static_cast<char*>(r->cq_ptr_);
+  r->cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  r->cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  r->cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  r->cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+  return r;
+}
+#else
+struct UringRing {};
+
+static std::unique_ptr<UringRing> setupRing(unsigned entries) {
+  return nullptr;
+}
+#endif
+
+UringDisk::UringDisk(const std::string& filename, int blocks,
+                     unsigned entries)
+    : FileDisk(filename, blocks),
+      ring_(),
+      entries_(entries),
+      inflight_(),
+      submitted_(0),
+      completed_(0),
+      ok_(true) {}
+
+UringDisk::~UringDisk() { wait(); }
+
+bool UringDisk::initialize(bool format) {
+  if (!FileDisk::initialize(format)) return false;
+  if (!ring_) ring_ = setupRing(entries_);
+  return true;
+}
+
+#ifdef HAVE_IO_URING
+bool UringDisk::submit(const Request* reqs, int n) {
+  if (!ring_) return FileDisk::submit(reqs, n);
+  auto& r = *ring_;
+  unsigned queued = 0;
+  for (int i = 0; i < n; i++) {
+    // never have more requests in flight than the rings can hold
+    while (submitted_ + queued - completed_ >= r.sq_entries_) {
+      if (!push(queued, 1)) return false;
+      queued = 0;
+      reap();
+    }
+    unsigned tail = *r.sq_tail_;
+    unsigned idx = tail & *r.sq_mask_;
+    auto sqe = &r.sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = reqs[i].write_ ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd_;
+    sqe->off = static_cast<uint64_t>(reqs[i].blockNo_) * BLOCK_SIZE;
+    sqe->addr = reinterpret_cast<uint64_t>(reqs[i].iov_);
+    sqe->len = reqs[i].iovcnt_;
+    sqe->user_data = inflight_.size();
+    inflight_.push_back(reqs[i]);
+    r.sq_array_[idx] = idx;
+    __atomic_store_n(r.sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+  }
+  return !queued || push(queued, 0);
+}
+
+bool UringDisk::push(unsigned queued, unsigned min_complete) {
+  auto& r = *ring_;
+  bool ok = enter(queued, min_complete);
+  // the kernel only takes entries inside io_uring_enter: those it left are
+  // taken back off the ring, so that wait() never waits for them
+  unsigned tail = *r.sq_tail_;
+  unsigned left =
+      ok ? 0 : tail - __atomic_load_n(r.sq_head_, __ATOMIC_ACQUIRE);
+  if (left) {
+    __atomic_store_n(r.sq_tail_, tail - left, __ATOMIC_RELEASE);
+    inflight_.resize(inflight_.size() - left);
+  }
+  submitted_ += queued - left;
+  return ok;
+}
+
+bool UringDisk::wait() {
+  if (ring_) {
+    reap();
+    while (completed_ < submitted_) {
+      if (!enter(0, 1)) {
+        ok_ = false;
+        break;
+      }
+      reap();
+    }
+  }
+  inflight_.clear();
+  submitted_ = completed_ = 0;
+  bool ok = ok_;
+  ok_ = true;
+  return ok;
+}
+
+bool UringDisk::enter(unsigned to_submit, unsigned min_complete) {
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  do {
+    int ret = syscall(__NR_io_uring_enter, ring_->fd_, to_submit,
+                      min_complete, flags, nullptr, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EBUSY) {
+        // out of kernel resources: make room by reaping
+        reap();
+        continue;
+      }
+      return false;
+    }
+    to_submit -= std::min<unsigned>(ret, to_submit);
+  } while (to_submit);
+  return true;
+}
+
+void UringDisk::reap() {
+  auto& r = *ring_;
+  unsigned head = *r.cq_head_;
+  unsigned tail = __atomic_load_n(r.cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    auto& cqe = r.cqes_[head & *r.cq_mask_];
+    auto& req = inflight_[cqe.user_data];
+    size_t len = 0;
+    for (int i = 0; i < req.iovcnt_; i++) len += req.iov_[i].iov_len;
+    if (cqe.res < 0 || static_cast<size_t>(cqe.res) != len) {
+      // failed or short (e.g. past the end of the image): redo synchronously
+      ok_ &= transfer(req.write_, req.iov_, req.iovcnt_, req.blockNo_);
+    }
+    completed_++;
+  }
+  __atomic_store_n(r.cq_head_, head, __ATOMIC_RELEASE);
+}
+#else
+bool UringDisk::submit(const Request* reqs, int n) {
+  return FileDisk::submit(reqs, n);
+}
+
+bool UringDisk::wait() { return true; }
+
+bool UringDisk::push(unsigned queued, unsigned min_complete) {
+  return false;
+}
+
+bool UringDisk::enter(unsigned to_submit, unsigned min_complete) {
+  return false;
+}
+
+void UringDisk::reap() {}
+#endif
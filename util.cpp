@@ -1,27 +1,28 @@
 #include "util.h"
-#include <sstream>
-#include <cmath>
-std::vector<std::string> splitPath(const std::string& path) {
-  char delimiter = '/';
-  std::vector<std::string> result;
-  std::istringstream iss(path);
-  std::string token;
 
-  while (std::getline(iss, token, delimiter)) {
-    result.push_back(token);
-  }
+#include <algorithm>
+#include <cmath>
 
-  return result;
+bool PathWalker::next(std::string_view* name) {
+  while (!rest_.empty() && rest_[0] == '/') rest_.remove_prefix(1);
+  if (rest_.empty()) return false;
+  auto pos = std::min(rest_.find('/'), rest_.size());
+  *name = rest_.substr(0, pos);
+  rest_.remove_prefix(pos);
+  return true;
 }
 
-std::tuple<std::string, std::string> splitPathParent(const std::string& path) {
-    char delimiter = '/';
-  std::string::size_type pos = path.find_last_of(delimiter);
-  if (pos == std::string::npos) {
-    return std::make_tuple("", path);
+uint32_t findBit(const uint64_t* words, size_t n, uint32_t i, bool val) {
+  uint32_t end = 64 * n;
+  while (i < end) {
+    uint64_t w = val ? words[i / 64] : ~words[i / 64];
+    w &= ~uint64_t(0) << i % 64;
+    if (w) return i / 64 * 64 + __builtin_ctzll(w);
+    i = (i / 64 + 1) * 64;
   }
-  return std::make_tuple(path.substr(0, pos), path.substr(pos + 1));
+  return end;
 }
+
 bool isPowerOf(int num, int base) {
   double result = log(num) / log(base);
   return (result - (int)result) == 0;
@@ -1,7 +1,22 @@
-#include <string>
-#include <vector>
-#include <tuple>
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Iterates the components of a '/'-separated path in place, without
+// copying. Empty components, as in "//" or a trailing '/', are skipped.
+class PathWalker {
+ public:
+  explicit PathWalker(std::string_view path) : rest_(path) {}
+  // the next component into *name; false past the last one
+  bool next(std::string_view* name);
+
+ private:
+  std::string_view rest_;
+};
+
+// the first bit at or after i equal to val in the n words of a bitmap, or
+// 64 * n; bit i is bit i % 64 of words[i / 64]
+uint32_t findBit(const uint64_t* words, size_t n, uint32_t i, bool val);
 
-std::vector<std::string> splitPath(const std::string& path);
-std::tuple<std::string, std::string> splitPathParent(const std::string& path);
 bool isPowerOf(int num, int base);
\ No newline at end of file